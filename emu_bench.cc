@@ -0,0 +1,202 @@
+/* Benchmarks the emulator library's primitives by playing back a
+   movie against its rom:
+
+     emu_bench [game.nes movie.fm2]
+
+   (karate.nes and karate.fm2 by default, like emu_test). Results
+   go to stdout, one per line, as "BENCH", a metric name and a number
+   separated by tabs, so that runs can be compared with a script
+   (the emulator prints other stuff to stdout, too). Times are
+   nanoseconds per operation. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "fceu/types.h"
+
+#include "../cc-lib/timer.h"
+
+#include "simplefm2.h"
+#include "emulator.h"
+#include "tasbot.h"
+
+// Number of states along the movie used for the save, load and cache
+// tests.
+#define NUM_STATES 1000
+// Each timed loop does about this many operations.
+#define NUM_OPS 20000
+
+static void Report(const char *metric, double value) {
+  printf("BENCH\t%s\t%.2f\n", metric, value);
+  fflush(stdout);
+}
+
+static double NsPer(const Timer &t, int ops) {
+  return t.Seconds() * 1.0e9 / (double)ops;
+}
+
+int main(int argc, char *argv[]) {
+  string romfile = "karate.nes", moviefile = "karate.fm2";
+  if (argc == 3) {
+    romfile = argv[1];
+    moviefile = argv[2];
+  } else if (argc != 1) {
+    fprintf(stderr, "Usage: emu_bench [game.nes movie.fm2]\n");
+    return -1;
+  }
+
+  CHECK(Emulator::Initialize(romfile));
+  vector<uint8> inputs = SimpleFM2::ReadInputs(moviefile);
+  CHECK(!inputs.empty());
+
+  vector<uint8> beginning;
+  Emulator::SaveUncompressed(&beginning);
+
+  fprintf(stderr, "Playing %d frames...\n", (int)inputs.size());
+  {
+    Timer steps;
+    for (int i = 0; i < inputs.size(); i++) {
+      Emulator::Step(inputs[i]);
+    }
+    steps.Stop();
+    Report("step_fps", inputs.size() / steps.Seconds());
+  }
+
+  // States spread evenly along the movie. The nth state is from
+  // before issuing inputs[frames[n]].
+  fprintf(stderr, "Collecting states...\n");
+  const int num_states = min((int)inputs.size(), NUM_STATES);
+  vector<int> frames;
+  vector< vector<uint8> > states;
+  Emulator::LoadUncompressed(&beginning);
+  for (int i = 0, n = 0; i < inputs.size() && n < num_states; i++) {
+    if ((int64)i * num_states / inputs.size() == n) {
+      frames.push_back(i);
+      states.resize(states.size() + 1);
+      Emulator::SaveUncompressed(&states.back());
+      n++;
+    }
+    Emulator::Step(inputs[i]);
+  }
+  Report("state_bytes", states[0].size());
+
+  // A basis from the middle of the movie, for SaveEx and LoadEx.
+  vector<uint8> basis;
+  Emulator::LoadUncompressed(&states[states.size() / 2]);
+  Emulator::GetBasis(&basis);
+
+  fprintf(stderr, "Saves and loads...\n");
+  {
+    Emulator::LoadUncompressed(&states[0]);
+    vector<uint8> out;
+    Timer saves;
+    for (int i = 0; i < NUM_OPS; i++) {
+      Emulator::SaveUncompressed(&out);
+    }
+    saves.Stop();
+    Report("save_uncompressed_ns", NsPer(saves, NUM_OPS));
+  }
+
+  {
+    // Alternating between states, so that every load has to
+    // restore something.
+    Timer loads;
+    for (int i = 0; i < NUM_OPS; i++) {
+      Emulator::LoadUncompressed(&states[i % num_states]);
+    }
+    loads.Stop();
+    Report("load_uncompressed_ns", NsPer(loads, NUM_OPS));
+  }
+
+  {
+    // Reloading the same state, as the search does between futures.
+    Emulator::LoadUncompressed(&states[0]);
+    Timer loads;
+    for (int i = 0; i < NUM_OPS; i++) {
+      Emulator::LoadUncompressed(&states[0]);
+    }
+    loads.Stop();
+    Report("reload_uncompressed_ns", NsPer(loads, NUM_OPS));
+  }
+
+  vector< vector<uint8> > compressed(num_states);
+  {
+    Timer saves;
+    for (int i = 0; i < num_states; i++) {
+      Emulator::LoadUncompressed(&states[i]);
+      Emulator::SaveEx(&compressed[i], &basis);
+    }
+    saves.Stop();
+    // Includes the LoadUncompressed, which is small in comparison.
+    Report("saveex_ns", NsPer(saves, num_states));
+  }
+
+  {
+    int64 total = 0;
+    for (int i = 0; i < num_states; i++) total += compressed[i].size();
+    Report("saveex_bytes", total / (double)num_states);
+  }
+
+  {
+    Timer loads;
+    for (int i = 0; i < num_states; i++) {
+      Emulator::LoadEx(&compressed[i], &basis);
+    }
+    loads.Stop();
+    Report("loadex_ns", NsPer(loads, num_states));
+  }
+
+  fprintf(stderr, "Caching steps...\n");
+  // For each hit rate, warm the cache with that percentage of the
+  // states and their inputs, then step from all of them. Times
+  // include loading the state before each step.
+  static const int kHitRates[] = { 0, 50, 90, 100 };
+  for (int h = 0; h < sizeof (kHitRates) / sizeof (int); h++) {
+    const int pct = kHitRates[h];
+    Emulator::ResetCache(num_states * 2, 10);
+    for (int i = 0; i < num_states; i++) {
+      if (i % 100 < pct) {
+	Emulator::LoadUncompressed(&states[i]);
+	Emulator::CachingStep(inputs[frames[i]]);
+      }
+    }
+
+    Timer steps;
+    for (int i = 0; i < num_states; i++) {
+      Emulator::LoadUncompressed(&states[i]);
+      Emulator::CachingStep(inputs[frames[i]]);
+    }
+    steps.Stop();
+    char metric[64];
+    sprintf(metric, "caching_step_hit%d_ns", pct);
+    Report(metric, NsPer(steps, num_states));
+  }
+
+  fprintf(stderr, "Memory...\n");
+  {
+    Emulator::LoadUncompressed(&states[0]);
+    vector<uint8> mem;
+    uint64 cxsum = 0;
+    Timer gets;
+    for (int i = 0; i < NUM_OPS; i++) {
+      Emulator::GetMemory(&mem);
+      cxsum += mem[i % mem.size()];
+    }
+    gets.Stop();
+    Report("get_memory_ns", NsPer(gets, NUM_OPS));
+
+    Timer sums;
+    for (int i = 0; i < NUM_OPS; i++) {
+      cxsum += Emulator::RamChecksum();
+    }
+    sums.Stop();
+    Report("ram_checksum_ns", NsPer(sums, NUM_OPS));
+    // So that the loops can't be optimized out.
+    fprintf(stderr, "(checksum %llx)\n", (unsigned long long)cxsum);
+  }
+
+  Emulator::Shutdown();
+  return 0;
+}
@@ -2,7 +2,9 @@
 #include "emulator.h"
 
 #include <algorithm>
+#include <list>
 #include <string>
+#include <string.h>
 #include <vector>
 #include <zlib.h>
 #ifdef __GNUC__
@@ -19,6 +21,7 @@ using tr1::unordered_map;
 #include "fceu/utils/md5.h"
 #include "fceu/version.h"
 #include "fceu/state.h"
+#include "fceu/input.h"
 
 #include "tasbot.h"
 #include "../cc-lib/city/city.h"
@@ -29,151 +32,404 @@ using tr1::unordered_map;
 // Joystick data. I think used for both controller 0 and 1. Part of
 // the "API".
 static uint32 joydata = 0;
+// Bits of joydata that the game read during the last step.
+static uint8 input_mask = 0;
 static bool initialized = false;
 
+// Codecs for cached states. States are mostly the same as one
+// another, so XORing against a basis state mostly yields zeroes.
+
+static void PutVarint(uint32 v, vector<uint8> *out) {
+  while (v >= 0x80) {
+    out->push_back((v & 0x7F) | 0x80);
+    v >>= 7;
+  }
+  out->push_back(v);
+}
+
+static uint32 GetVarint(const vector<uint8> &in, int *pos) {
+  uint32 v = 0;
+  for (int shift = 0; ; shift += 7) {
+    CHECK(*pos < in.size());
+    const uint8 b = in[(*pos)++];
+    v |= (uint32)(b & 0x7F) << shift;
+    if (!(b & 0x80)) return v;
+  }
+}
+
+// Bytes past the end of the basis are treated as zero.
+static inline uint8 BasisByte(const vector<uint8> &basis, int i) {
+  return i < basis.size() ? basis[i] : 0;
+}
+
+// The state's length, then (zeroes, literals, literal bytes...)
+// groups, where the literals are the XOR of the state with the basis.
+static void EncodeDiff(const vector<uint8> &basis,
+		       const vector<uint8> &state,
+		       vector<uint8> *out) {
+  out->clear();
+  PutVarint(state.size(), out);
+  int i = 0;
+  while (i < state.size()) {
+    int zeroes = 0;
+    while (i < state.size() && state[i] == BasisByte(basis, i)) {
+      zeroes++;
+      i++;
+    }
+    // Literals run until two matching bytes in a row, since a
+    // single zero is cheaper to keep than a new group.
+    int start = i;
+    while (i < state.size() &&
+	   !(state[i] == BasisByte(basis, i) &&
+	     (i + 1 == state.size() ||
+	      state[i + 1] == BasisByte(basis, i + 1)))) {
+      i++;
+    }
+    PutVarint(zeroes, out);
+    PutVarint(i - start, out);
+    for (int j = start; j < i; j++) {
+      out->push_back(state[j] ^ BasisByte(basis, j));
+    }
+  }
+}
+
+static void DecodeDiff(const vector<uint8> &basis,
+		       const vector<uint8> &in,
+		       vector<uint8> *state) {
+  int pos = 0;
+  const int len = GetVarint(in, &pos);
+  state->resize(len);
+  int i = 0;
+  while (i < len) {
+    const int zeroes = GetVarint(in, &pos);
+    const int literals = GetVarint(in, &pos);
+    CHECK(i + zeroes + literals <= len);
+    for (int j = 0; j < zeroes; j++, i++) {
+      (*state)[i] = BasisByte(basis, i);
+    }
+    CHECK(pos + literals <= in.size());
+    for (int j = 0; j < literals; j++, i++) {
+      (*state)[i] = in[pos++] ^ BasisByte(basis, i);
+    }
+  }
+}
+
+// The state's length (4 bytes), then zlib's fastest compression of
+// the XOR of the state with the basis.
+static void EncodeZlib(const vector<uint8> &basis,
+		       const vector<uint8> &state,
+		       vector<uint8> *out) {
+  vector<uint8> diff(state);
+  for (int i = 0; i < diff.size(); i++) {
+    diff[i] ^= BasisByte(basis, i);
+  }
+
+  uLongf comprlen = compressBound(diff.size());
+  out->resize(4 + comprlen);
+  if (Z_OK != compress2(&(*out)[4], &comprlen, &diff[0], diff.size(),
+			Z_BEST_SPEED)) {
+    fprintf(stderr, "Couldn't compress.\n");
+    abort();
+  }
+  *(uint32*)&(*out)[0] = diff.size();
+  out->resize(4 + comprlen);
+}
+
+static void DecodeZlib(const vector<uint8> &basis,
+		       const vector<uint8> &in,
+		       vector<uint8> *state) {
+  CHECK(in.size() >= 4);
+  uLongf len = *(const uint32*)&in[0];
+  state->resize(len);
+  if (Z_OK != uncompress(&(*state)[0], &len, &in[4], in.size() - 4) ||
+      len != state->size()) {
+    fprintf(stderr, "Couldn't decompress cached state.\n");
+    abort();
+  }
+  for (int i = 0; i < state->size(); i++) {
+    (*state)[i] ^= BasisByte(basis, i);
+  }
+}
+
 struct StateCache {
-  // These vectors are allocated with new.
-  // Input and starting state (uncompresed).
-  typedef pair<uint8, const vector<uint8> *> Key;
-  // Sequence number and output state (uncompressed).
-  typedef pair<uint64, vector<uint8> *> Value;
+  // 128-bit hash of a savestate's contents, which we take to
+  // identify the state.
+  typedef pair<uint64, uint64> StateHash;
+
+  // Each distinct result state is stored once, shared by all of the
+  // entries that produce it. This is common, since the game usually
+  // ignores the input on many frames.
+  struct Blob {
+    Blob(const StateHash &hash, int raw_size)
+      : hash(hash), raw_size(raw_size), refs(0) {}
+    // Of the uncompressed state.
+    StateHash hash;
+    int raw_size;
+    // Encoded with the cache's codec.
+    vector<uint8> data;
+    int refs;
+  };
+
+  // Effective input and the hash of the starting state (see
+  // HashCurrentState). The effective input is the mask of the bits
+  // that the game read in the high byte, and the values of those
+  // bits in the low byte, so one entry serves every input that
+  // agrees with it on those bits.
+  typedef pair<uint16, StateHash> Key;
+  // Keys from most to least recently used.
+  typedef list<Key> LRU;
+  // Position in the LRU list and output state.
+  typedef pair<LRU::iterator, Blob *> Value;
+
+  static uint16 EffectiveInput(uint8 input, uint8 mask) {
+    return ((uint16)mask << 8) | (input & mask);
+  }
 
   struct HashFunction {
     size_t operator ()(const Key &k) const {
-      CHECK(k.second);
-      return CityHash64WithSeed((const char *)&(k.second->at(0)),
-				k.second->size(),
-				k.first);
+      // Already a good hash.
+      return k.second.first ^ (k.second.second * 0x9E3779B97F4A7C15ULL) ^
+	k.first;
     }
   };
 
-  // Use value equality on the vectors, not pointer equality
-  // (which would be the default for ==).
-  struct KeyEquals {
-    size_t operator ()(const Key &l, const Key &r) const {
-      return l.first == r.first &&
-	*l.second == *r.second;
+  struct BlobHashFunction {
+    size_t operator ()(const StateHash &h) const {
+      return h.first;
     }
   };
 
-  typedef unordered_map<Key, Value, HashFunction, KeyEquals> Hash;
+  typedef unordered_map<Key, Value, HashFunction> Hash;
+  typedef unordered_map<StateHash, Blob *, BlobHashFunction> BlobTable;
 
-  StateCache() : limit(0ULL), count(0ULL), next_sequence(0ULL), 
-		 slop(10000ULL), hits(0ULL), misses(0ULL) {
+  // Same capacity as the old default of no limit plus 10000 slop,
+  // for callers that don't ResetCache.
+  StateCache() : codec(Emulator::CACHE_RAW),
+		 limit(10000ULL), count(0ULL), raw_bytes(0ULL),
+		 blob_bytes(0ULL), hits(0ULL), misses(0ULL) {
+    memset(mask_seen, 0, sizeof (mask_seen));
   }
 
+  static StateHash HashState(const vector<uint8> &state) {
+    CHECK(!state.empty());
+    return CityHash128((const char *)&state[0], state.size());
+  }
+
+  // Slop is ignored, since we evict exactly at the limit.
   void Resize(uint64 ll, uint64 ss) {
     printf("Resize cache %d %d\n", ll, ss);
     // Recover memory.
-    for (Hash::iterator it = hashtable.begin(); 
-	 it != hashtable.end(); /* in loop */) {
-      Hash::iterator next(it);
-      ++next;
-      delete it->first.second;
-      delete it->second.second;
-      hashtable.erase(it);
-      it = next;
+    for (BlobTable::iterator it = blobs.begin(); it != blobs.end(); ++it) {
+      delete it->second;
     }
-    CHECK(hashtable.size() == 0);
+    blobs.clear();
+    hashtable.clear();
+    lru.clear();
+    masks.clear();
+    memset(mask_seen, 0, sizeof (mask_seen));
 
     limit = ll;
-    slop = ss;
     CHECK(limit >= 0);
-    CHECK(slop >= 0);
-    next_sequence = count = 0ULL;
+    count = 0ULL;
+    raw_bytes = blob_bytes = 0ULL;
     printf("OK.\n");
   }
 
-  // Assumes it's not present. If it is, then you'll leak.
-  void Remember(uint8 input, const vector<uint8> &start,
+  // Clears the cache, since existing entries use the old codec.
+  void SetCodec(Emulator::CacheCodec cc, const vector<uint8> &bb) {
+    Resize(limit, 0);
+    codec = cc;
+    basis = bb;
+  }
+
+  // Records that stepping with input from the start state, during
+  // which the game read the bits in mask, produced result. Assumes
+  // it's not present. If it is, then you'll leak.
+  void Remember(uint8 input, uint8 mask, const StateHash &start,
 		const vector<uint8> &result) {
-    vector<uint8> *startcopy = new vector<uint8>(start),
-                  *resultcopy = new vector<uint8>(result);
+    if (!mask_seen[mask]) {
+      mask_seen[mask] = true;
+      masks.push_back(mask);
+    }
+    const Key key = make_pair(EffectiveInput(input, mask), start);
+    lru.push_front(key);
     pair<Hash::iterator, bool> it =
-      hashtable.insert(make_pair(make_pair(input, startcopy), 
-				 make_pair(next_sequence++, resultcopy)));
+      hashtable.insert(make_pair(key, make_pair(lru.begin(),
+						InternBlob(result))));
     CHECK(it.second);
-    DCHECK(NULL != GetKnownResult(input, *startcopy));
-    DCHECK(NULL != GetKnownResult(input, start));
     count++;
-    MaybeResize();
+    while (count > limit) Evict();
   }
 
-  // Return a pointer to the result state (and update its LRU
-  // sequence) or NULL if it is not known.
-  vector<uint8> *GetKnownResult(uint8 input, const vector<uint8> &start) {
-    Hash::iterator it = hashtable.find(make_pair(input, &start));
-    if (it == hashtable.end()) {
-      misses++;
-      return NULL;
+  // If the result state is known, decode it into result, set mask
+  // to the bits that the game read, mark it most recently used, and
+  // return true. We don't know which bits the game will read from
+  // this state, so this tries each mask that any entry has. Games
+  // typically read all of the bits or none, so there are few.
+  bool GetKnownResult(uint8 input, const StateHash &start,
+		      vector<uint8> *result, uint8 *mask) {
+    for (int i = 0; i < masks.size(); i++) {
+      Hash::iterator it =
+	hashtable.find(make_pair(EffectiveInput(input, masks[i]), start));
+      if (it != hashtable.end()) {
+	hits++;
+	// Move to the front without copying or reallocating.
+	lru.splice(lru.begin(), lru, it->second.first);
+	Decode(it->second.second->data, result);
+	*mask = masks[i];
+	return true;
+      }
     }
 
-    hits++;
-    it->second.first = next_sequence++;
-    return it->second.second;
+    misses++;
+    return false;
   }
 
-  void MaybeResize() {
-    // Don't always do this, since it is linear time.
-    if (count > limit + slop) {
-      const int num_to_remove = count - limit;
-      // printf("Resizing (currently %d) to remove %d\n", count, num_to_remove);
+  // Removes the least recently used entry.
+  void Evict() {
+    CHECK(!lru.empty());
+    Hash::iterator it = hashtable.find(lru.back());
+    CHECK(it != hashtable.end());
+    lru.pop_back();
+    ReleaseBlob(it->second.second);
+    hashtable.erase(it);
+    count--;
+  }
 
-      // PERF: This can be done much more efficiently using a flat
-      // heap.
-      vector<uint64> all_sequences;
-      all_sequences.reserve(count);
+  // Returns the shared copy of the state, with a reference
+  // added for the caller.
+  Blob *InternBlob(const vector<uint8> &state) {
+    const StateHash h = HashState(state);
+    BlobTable::iterator it = blobs.find(h);
+    Blob *blob;
+    if (it == blobs.end()) {
+      blob = new Blob(h, state.size());
+      Encode(state, &blob->data);
+      blobs.insert(make_pair(h, blob));
+      raw_bytes += blob->raw_size;
+      blob_bytes += blob->data.size();
+    } else {
+      blob = it->second;
+    }
+    blob->refs++;
+    return blob;
+  }
 
-      // First pass, get the num_to_remove oldest (lowest) sequences.
-      for (Hash::const_iterator it = hashtable.begin(); 
-	   it != hashtable.end(); ++it) {
-	all_sequences.push_back(it->second.first);
-      }
-      std::sort(all_sequences.begin(), all_sequences.end());
-      
-      CHECK(num_to_remove < all_sequences.size());
-      const uint64 minseq = all_sequences[num_to_remove];
-
-      // printf("Removing everything below %d\n", minseq);
-
-      for (Hash::iterator it = hashtable.begin(); it != hashtable.end(); 
-	   /* in loop */) {
-	if (it->second.first < minseq) {
-	  Hash::iterator next(it);
-	  ++next;
-	  delete it->first.second;
-	  delete it->second.second;
-	  // Note g++ does not return the "next" iterator.
-	  hashtable.erase(it);
-	  count--;
-	  it = next;
-	} else {
-	  ++it;
-	}
-      }
-      // printf("Size is now %d (internally %d)\n", count, hashtable.size());
+  void ReleaseBlob(Blob *blob) {
+    CHECK(blob->refs > 0);
+    blob->refs--;
+    if (blob->refs == 0) {
+      blobs.erase(blob->hash);
+      raw_bytes -= blob->raw_size;
+      blob_bytes -= blob->data.size();
+      delete blob;
+    }
+  }
+
+  void Encode(const vector<uint8> &state, vector<uint8> *out) const {
+    switch (codec) {
+    case Emulator::CACHE_RAW:
+      *out = state;
+      break;
+    case Emulator::CACHE_DIFF:
+      EncodeDiff(basis, state, out);
+      break;
+    case Emulator::CACHE_ZLIB:
+      EncodeZlib(basis, state, out);
+      break;
+    }
+  }
+
+  void Decode(const vector<uint8> &in, vector<uint8> *state) const {
+    switch (codec) {
+    case Emulator::CACHE_RAW:
+      *state = in;
+      break;
+    case Emulator::CACHE_DIFF:
+      DecodeDiff(basis, in, state);
+      break;
+    case Emulator::CACHE_ZLIB:
+      DecodeZlib(basis, in, state);
+      break;
     }
   }
 
   void PrintStats() {
-    printf("Current cache size: %ld / %ld. next_seq %ld\n"
-	   "%ld hits and %ld misses\n", 
-	   count, limit, next_sequence,
-	   hits, misses);
+    printf("Current cache size: %llu / %llu. %llu distinct states "
+	   "(%.2f MB, %.2f MB encoded, %.1fx)\n"
+	   "%llu hits and %llu misses, %d input masks\n",
+	   count, limit, (uint64)blobs.size(),
+	   raw_bytes / (1024.0 * 1024.0),
+	   blob_bytes / (1024.0 * 1024.0),
+	   blob_bytes > 0 ? (double)raw_bytes / blob_bytes : 0.0,
+	   hits, misses, (int)masks.size());
   }
 
   Hash hashtable;
+  LRU lru;
+  BlobTable blobs;
+  // The distinct input masks in entries, in the order first seen.
+  // Not updated on eviction.
+  vector<uint8> masks;
+  bool mask_seen[256];
+
+  Emulator::CacheCodec codec;
+  // States are encoded relative to this, for codecs that use it.
+  vector<uint8> basis;
+
   uint64 limit;
   uint64 count;
-  uint64 next_sequence;
-  // Number of states I'm allowed to be over my limit before
-  // forcing a GC.
-  uint64 slop;
+  // Total size of the states in blobs, before and after encoding.
+  uint64 raw_bytes, blob_bytes;
 
   uint64 hits, misses;
 };
 static StateCache *cache = NULL;
 
+// Hashes the current state in place, by visiting the same memory
+// that SaveUncompressed would copy. Equal states get equal hashes,
+// but these hashes are not comparable to StateCache::HashState of a
+// saved state. Small fields (like CPU registers) are batched up,
+// since each hash call has some overhead.
+struct LiveHasher {
+  LiveHasher() : hash(0ULL, 0ULL), size(0) {}
+
+  static void Visit(void *arg, const uint8 *data, uint32 len) {
+    LiveHasher *self = (LiveHasher *)arg;
+    if (len <= sizeof (self->small)) {
+      if (self->size + len > sizeof (self->small)) self->Flush();
+      memcpy(self->small + self->size, data, len);
+      self->size += len;
+    } else {
+      self->Flush();
+      self->hash = CityHash128WithSeed((const char *)data, len, self->hash);
+    }
+  }
+
+  StateCache::StateHash Finish() {
+    Flush();
+    return hash;
+  }
+
+ private:
+  void Flush() {
+    if (size > 0) {
+      hash = CityHash128WithSeed((const char *)small, size, hash);
+      size = 0;
+    }
+  }
+
+  StateCache::StateHash hash;
+  uint8 small[256];
+  int size;
+};
+
+static StateCache::StateHash HashCurrentState() {
+  LiveHasher hasher;
+  FCEUSS_VisitRAW(&LiveHasher::Visit, &hasher);
+  return hasher.Finish();
+}
+
 void Emulator::GetMemory(vector<uint8> *mem) {
   mem->resize(0x800);
   memcpy(&((*mem)[0]), RAM, 0x800);
@@ -362,6 +618,12 @@ void Emulator::Step(uint8 inputs) {
 
   // Emulate a single frame.
   FCEUI_Emulate(NULL, &sound, &ssize, SKIP_VIDEO_AND_SOUND);
+
+  input_mask = FCEU_FinishInputFrame();
+}
+
+uint8 Emulator::InputMask() {
+  return input_mask;
 }
 
 void Emulator::Save(vector<uint8> *out) {
@@ -373,11 +635,11 @@ void Emulator::GetBasis(vector<uint8> *out) {
 }
 
 void Emulator::SaveUncompressed(vector<uint8> *out) {
-  FCEUSS_SaveRAW(out);
+  FCEUSS_SaveFlat(out);
 }
 
 void Emulator::LoadUncompressed(vector<uint8> *in) {
-  if (!FCEUSS_LoadRAW(in)) {
+  if (!FCEUSS_LoadFlat(in)) {
     fprintf(stderr, "Couldn't restore from state\n");
     abort();
   }
@@ -436,11 +698,12 @@ void Emulator::SaveEx(vector<uint8> *state, const vector<uint8> *basis) {
 
 void Emulator::LoadEx(vector<uint8> *state, const vector<uint8> *basis) {
   // Decompress. First word tells us the decompressed size.
-  int uncomprlen = *(uint32*)&(*state)[0];
+  // Must be uLongf, which is wider than int on LP64.
+  uLongf uncomprlen = *(uint32*)&(*state)[0];
   vector<uint8> uncompressed;
   uncompressed.resize(uncomprlen);
  
-  switch (uncompress(&uncompressed[0], (uLongf*)&uncomprlen,
+  switch (uncompress(&uncompressed[0], &uncomprlen,
 		     &(*state)[4], state->size() - 4)) {
   case Z_OK: break;
   case Z_BUF_ERROR:
@@ -501,19 +764,64 @@ void Emulator::ResetCache(uint64 numstates, uint64 slop) {
 
 // static
 void Emulator::CachingStep(uint8 input) {
-  vector<uint8> start;
-  SaveUncompressed(&start);
-  if (vector<uint8> *cached = cache->GetKnownResult(input, start)) {
-    LoadUncompressed(cached);
+  // Only the result is ever saved, and only on a miss. Reused, so
+  // that hits don't allocate once these have grown to size.
+  static vector<uint8> scratch;
+  const StateCache::StateHash start_hash = HashCurrentState();
+  if (cache->GetKnownResult(input, start_hash, &scratch, &input_mask)) {
+    LoadUncompressed(&scratch);
   } else {
     Step(input);
-    vector<uint8> result;
-    SaveUncompressed(&result);
-    cache->Remember(input, start, result);
+    SaveUncompressed(&scratch);
+    cache->Remember(input, input_mask, start_hash, scratch);
+  }
+}
+
+// static
+void Emulator::StepMany(const uint8 *inputs, size_t n, uint8 *ram_out) {
+  for (size_t i = 0; i < n; i++) {
+    Step(inputs[i]);
+    memcpy(ram_out + i * 0x800, RAM, 0x800);
+  }
+}
+
+// static
+void Emulator::CachingStepMany(const uint8 *inputs, size_t n,
+			       uint8 *ram_out) {
+  for (size_t i = 0; i < n; i++) {
+    CachingStep(inputs[i]);
+    memcpy(ram_out + i * 0x800, RAM, 0x800);
+  }
+}
+
+// static
+void Emulator::StepMany(const uint8 *inputs, size_t n,
+			StepCallback f, void *arg) {
+  for (size_t i = 0; i < n; i++) {
+    Step(inputs[i]);
+    (*f)(arg, i, RAM);
+  }
+}
 
-    // PERF
-    CHECK(NULL != cache->GetKnownResult(input, start));
+// static
+void Emulator::CachingStepMany(const uint8 *inputs, size_t n,
+			       StepCallback f, void *arg) {
+  for (size_t i = 0; i < n; i++) {
+    CachingStep(inputs[i]);
+    (*f)(arg, i, RAM);
+  }
+}
+
+// static
+void Emulator::SetCacheCodec(CacheCodec codec, const vector<uint8> *basis) {
+  CHECK(cache != NULL);
+  vector<uint8> current;
+  if (basis == NULL) {
+    // Same format as the cached states, unlike GetBasis.
+    SaveUncompressed(&current);
+    basis = &current;
   }
+  cache->SetCodec(codec, *basis);
 }
 
 void Emulator::PrintCacheStats() {
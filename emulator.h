@@ -3,7 +3,9 @@
 
   Ideally this would be a proper class (really no reason not to),
   but because FCEUX uses loads of global variables, this has
-  to be treated as a singleton.
+  to be treated as a singleton. To run several emulators at once
+  on one machine, use WorkerPool (worker-pool.h), which gives each
+  one its own forked copy of the process.
 */
 
 #ifndef __EMULATOR_H
@@ -31,6 +33,13 @@ struct Emulator {
   //    RLDUTSBA (Right, Left, Down, Up, sTart, Select, B, A)
   static void Step(uint8 inputs);
 
+  // The bits of the input that the game actually read during the
+  // last Step or CachingStep (zero on a lag frame). Any input that
+  // agrees with that one on these bits would have produced exactly
+  // the same state, so (input & InputMask()) is a canonical
+  // "effective input" for the step.
+  static uint8 InputMask();
+
   // Copy the 0x800 bytes of RAM.
   static void GetMemory(vector<uint8> *mem);
 
@@ -42,18 +51,55 @@ struct Emulator {
 
   // Reset the state cache. Set the maximum number of states that can
   // be stored. (A state is a starting state, an input, and the output
-  // state that results.) The number of actual states stored can
-  // exceed numstates by a constant amount called slop. Clears the cache.
+  // state that results.) When full, the least recently used state is
+  // evicted. Slop is ignored; it is only here for compatibility with
+  // callers. Clears the cache.
   static void ResetCache(uint64 numstates, uint64 slop = 10000ULL);
 
   // Equivalent to Step. Does some extra work to consult the cache and
   // save the result, which may make it much faster. However, when
   // iterating steps, checking the cache and saving results are pure
-  // overhead.
+  // overhead. Inputs that are equivalent (see InputMask) share a
+  // cache entry.
   static void CachingStep(uint8 input);
 
+  // Steps with each of the n inputs in turn, copying the 0x800 bytes
+  // of RAM after each step to ram_out, which must have room for
+  // n * 0x800 bytes. Like Step (or CachingStep) and GetMemory in a
+  // loop, but doesn't allocate, and leaves the memories contiguous.
+  static void StepMany(const uint8 *inputs, size_t n, uint8 *ram_out);
+  static void CachingStepMany(const uint8 *inputs, size_t n, uint8 *ram_out);
+
+  // Same, but instead calls f(arg, i, ram) after the ith step, where
+  // ram is the emulator's 0x800 bytes of RAM. It is only valid during
+  // the call, and the callback must not modify it.
+  typedef void (*StepCallback)(void *arg, size_t i, const uint8 *ram);
+  static void StepMany(const uint8 *inputs, size_t n,
+                       StepCallback f, void *arg);
+  static void CachingStepMany(const uint8 *inputs, size_t n,
+                              StepCallback f, void *arg);
+
   static void PrintCacheStats();
 
+  // How the cache stores states. RAW is what SaveUncompressed
+  // produces; fastest but largest. DIFF is the XOR against a basis
+  // with runs of zeroes left out, which is cheap and usually much
+  // smaller. ZLIB compresses that XOR with zlib's fastest setting,
+  // which is smaller still but costs more on every hit and miss.
+  // PrintCacheStats shows the ratio achieved.
+  enum CacheCodec {
+    CACHE_RAW,
+    CACHE_DIFF,
+    CACHE_ZLIB
+  };
+
+  // Sets the codec for cached states, and the basis that DIFF and
+  // ZLIB encode against, in the format of SaveUncompressed. If basis
+  // is NULL, uses the current state, so this is best called once the
+  // game is in a representative state. Clears the cache. Default is
+  // CACHE_RAW.
+  static void SetCacheCodec(CacheCodec codec, const vector<uint8> *basis);
+
   // States often only differ by a small amount, so a way to reduce
   // their entropy is to diff them against a representative savestate.
   // This gets an uncompressed basis for the current state, which can
@@ -63,6 +109,13 @@ struct Emulator {
   // Save and load uncompressed. The memory will always be the same
   // size (Save and SaveEx may compress, which makes their output
   // significantly smaller), but this is the fastest in terms of CPU.
+  // These are just a fixed list of memcpys, with no tags or byte
+  // swapping, so they can only be loaded by the same build running
+  // the same game (like another process of the same playfun). Use
+  // Save or SaveEx for anything that goes in a file. Loading skips
+  // the big regions (nametables, CHR and work RAM) that haven't been
+  // written since the last save or load and already match, so
+  // reloading a recent state is cheaper still.
   static void SaveUncompressed(vector<uint8> *out);
   static void LoadUncompressed(vector<uint8> *in);
 
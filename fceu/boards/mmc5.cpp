@@ -106,12 +106,18 @@ static void mmc5_PPUWrite(uint32 A, uint8 V) {
 		else if(tmp<0x2000)
 		{
 			if(PPUCHRRAM&(1<<(tmp>>10)))
+			{
 				VPage[tmp>>10][tmp]=V;
+				FCEUSS_MarkDirty(&VPage[tmp>>10][tmp]);
+			}
 		}
 		else
 		{
 			if(PPUNTARAM&(1<<((tmp&0xF00)>>10)))
+			{
 				vnapage[((tmp&0xF00)>>10)][tmp&0x3FF]=V;
+				FCEUSS_MarkDirty(&vnapage[((tmp&0xF00)>>10)][tmp&0x3FF]);
+			}
 		}
 }
 
@@ -747,6 +747,8 @@ void ResetNES(void)
 	extern uint8 *XBackBuf;
 	memset(XBackBuf,0,256*256);
 
+	FCEUSS_DirtyAll();
+
 	FCEU_DispMessage("Reset", 0);
 }
 
@@ -812,6 +814,8 @@ void PowerNES(void)
   extern uint8 *XBackBuf;
   memset(XBackBuf,0,256*256);
 
+  FCEUSS_DirtyAll();
+
   FCEU_DispMessage("Power on", 0);
 }
 
@@ -88,6 +88,9 @@ extern bool movieSubtitles;
 
 static uint8 joy_readbit[2];
 uint8 joy[4]={0,0,0,0}; //HACK - should be static but movie needs it
+// Bits of each joy[] that the game has read since the last
+// FCEU_UpdateInput. -tom7
+static uint8 joy_observed[4]={0,0,0,0};
 static uint8 LastStrobe;
 
 bool replaceP2StartWithMicrophone = false;
@@ -217,6 +220,7 @@ static uint8 ReadGPVS(int w)
 	else
 	{
 		ret = ((joy[w]>>(joy_readbit[w]))&1);
+		joy_observed[w] |= 1<<joy_readbit[w];
 		if(!fceuindbg)
 			joy_readbit[w]++;
 	}
@@ -287,9 +291,15 @@ static uint8 ReadGP(int w)
 	uint8 ret;
 
 	if(joy_readbit[w]>=8)
+	{
 		ret = ((joy[2+w]>>(joy_readbit[w]&7))&1);
+		if(joy_readbit[w]<16) joy_observed[2+w] |= 1<<(joy_readbit[w]&7);
+	}
 	else
+	{
 		ret = ((joy[w]>>(joy_readbit[w]))&1);
+		joy_observed[w] |= 1<<joy_readbit[w];
+	}
 	if(joy_readbit[w]>=16) ret=0;
 	if(!FSAttached)
 	{
@@ -345,6 +355,20 @@ void FCEU_UpdateInput(void)
 	//TODO - should this apply to the movie data? should this be displayed in the input hud?
 	if(GameInfo->type==GIT_VSUNI)
 		FCEU_VSUniSwap(&joy[0],&joy[1]);
+
+	memset(joy_observed,0,sizeof(joy_observed));
+}
+
+uint8 FCEU_FinishInputFrame(void)
+{
+	// joy[] is saved in states, but never read again before the next
+	// FCEU_UpdateInput overwrites it.
+	for(int i=0;i<4;i++)
+		joy[i] &= joy_observed[i];
+
+	// Player 1 is in joy[1] if VSUniSwap swapped them; it's harmless
+	// to include player 2 otherwise.
+	return joy_observed[0] | joy_observed[1];
 }
 
 static DECLFR(VSUNIRead0)
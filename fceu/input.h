@@ -93,6 +93,11 @@ extern struct FCPORT
 
 void FCEU_DrawInput(uint8 *buf);
 void FCEU_UpdateInput(void);
+// For tasbot. Call after emulating a frame. Returns the bits of
+// player 1's gamepad that the game read during the frame (zero on a
+// lag frame), and clears the others from the saved input, so that
+// inputs that agree on the bits read result in identical states.
+uint8 FCEU_FinishInputFrame(void);
 void InitializeInput(void);
 void FCEU_UpdateBot(void);
 extern void (*PStrobe[2])(void);
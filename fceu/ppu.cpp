@@ -414,12 +414,18 @@ inline void FFCEUX_PPUWrite_Default(uint32 A, uint8 V) {
     if(tmp<0x2000)
     {
         if(PPUCHRRAM&(1<<(tmp>>10)))
+        {
             VPage[tmp>>10][tmp]=V;
+            FCEUSS_MarkDirty(&VPage[tmp>>10][tmp]);
+        }
     }
     else if (tmp<0x3F00)
     {
         if(PPUNTARAM&(1<<((tmp&0xF00)>>10)))
+        {
             vnapage[((tmp&0xF00)>>10)][tmp&0x3FF]=V;
+            FCEUSS_MarkDirty(&vnapage[((tmp&0xF00)>>10)][tmp&0x3FF]);
+        }
     }
     else
     {
@@ -1037,12 +1043,18 @@ static DECLFW(B2007)
 		else if(tmp<0x2000)
 		{
 			if(PPUCHRRAM&(1<<(tmp>>10)))
+			{
 				VPage[tmp>>10][tmp]=V;
+				FCEUSS_MarkDirty(&VPage[tmp>>10][tmp]);
+			}
 		}
 		else
 		{
 			if(PPUNTARAM&(1<<((tmp&0xF00)>>10)))
+			{
 				vnapage[((tmp&0xF00)>>10)][tmp&0x3FF]=V;
+				FCEUSS_MarkDirty(&vnapage[((tmp&0xF00)>>10)][tmp&0x3FF]);
+			}
 		}
 		//      FCEU_printf("ppu (%04x) %04x:%04x %d, %d\n",X.PC,RefreshAddr,PPUGenLatch,scanline,timestamp);
 		if(INC32) RefreshAddr+=32;
@@ -239,6 +239,9 @@ static bool ReadStateChunks(EMUFILE* is, int32 totalsize)
 	read_sfcpuc=0;
 	read_snd=0;
 
+	// Overwrites everything, without telling the flat state tracking.
+	FCEUSS_DirtyAll();
+
 	//mbg 6/16/08 - wtf
 	//// int moo=X.mooPI;
 	// if(!scan_chunks)
@@ -379,6 +382,280 @@ bool FCEUSS_SaveRAW(std::vector<uint8> *out) {
   return true;
 }
 
+static void SubVisit(SFORMAT *sf,
+                     void (*visit)(void *arg, const uint8 *data, uint32 len),
+                     void *arg) {
+  while (sf->v) {
+    // Link to another struct.
+    if (sf->s == ~0) {
+      SubVisit((SFORMAT *)sf->v, visit, arg);
+      sf++;
+      continue;
+    }
+
+    const uint32 len = sf->s & (~FCEUSTATE_FLAGS);
+    if (sf->s & FCEUSTATE_INDIRECT)
+      visit(arg, *(const uint8 **)sf->v, len);
+    else
+      visit(arg, (const uint8 *)sf->v, len);
+    sf++;
+  }
+}
+
+void FCEUSS_VisitRAW(void (*visit)(void *arg, const uint8 *data, uint32 len),
+                     void *arg) {
+  // Same hooks and order as FCEUSS_SaveRAW.
+  FCEUPPU_SaveState();
+  FCEUSND_SaveState();
+  SubVisit(SFCPU, visit, arg);
+  SubVisit(SFCPUC, visit, arg);
+  SubVisit(FCEUPPU_STATEINFO, visit, arg);
+  SubVisit(FCEU_NEWPPU_STATEINFO, visit, arg);
+  SubVisit(FCEUCTRL_STATEINFO, visit, arg);
+  SubVisit(FCEUSND_STATEINFO, visit, arg);
+
+  if(SPreSave) SPreSave();
+  SubVisit(SFMDATA, visit, arg);
+  if(SPreSave) SPostSave();
+}
+
+// Plan for flat saves: every region that FCEUSS_SaveRAW saves, in the
+// same order, but with no tags, sizes or byte swapping. Computed on
+// first use, and again if the mapper's state (SFMDATA) changes.
+//
+// Large regions that are only written through a few paths (nametable,
+// CHR and work RAM) are tracked: we remember whether each has been
+// written since the last flat save or load, and the flat state ends
+// with a fingerprint of each one's contents. Loading skips a tracked
+// region if it is clean and already has the saved contents, which is
+// the common case when reloading a recent state.
+enum FlatKind {
+  // Always copied.
+  FLAT_COPY,
+  // Only written by the PPU; see FCEUSS_MarkDirty.
+  FLAT_PPU,
+  // Also written by the cartridge in response to CPU writes.
+  FLAT_CART,
+};
+// Regions smaller than this are always copied; it's not worth it.
+#define FLAT_TRACK_MIN 1024
+struct FlatRegion {
+  void *v;
+  uint32 len;
+  bool indirect;
+  FlatKind kind;
+  // For tracked regions.
+  bool dirty;
+  uint64 fingerprint;
+};
+static std::vector<FlatRegion> flat_plan;
+// Indices into flat_plan of the tracked regions.
+static std::vector<int> flat_tracked;
+// Index of the first region from SFMDATA, which is bracketed by the
+// SPreSave/SPostSave hooks.
+static int flat_mapper_start = 0;
+// Size of the region data, which is followed by a fingerprint for
+// each tracked region.
+static uint32 flat_data_size = 0;
+static uint32 flat_size = 0;
+static bool flat_plan_ok = false;
+
+bool FCEUSS_cart_dirty = true;
+
+static void AddFlatRegions(SFORMAT *sf, bool ppu, bool mapper) {
+  while (sf->v) {
+    // Link to another struct.
+    if (sf->s == ~0) {
+      AddFlatRegions((SFORMAT *)sf->v, ppu, mapper);
+      sf++;
+      continue;
+    }
+
+    FlatRegion r;
+    r.v = sf->v;
+    r.len = sf->s & (~FCEUSTATE_FLAGS);
+    r.indirect = !!(sf->s & FCEUSTATE_INDIRECT);
+    r.kind = FLAT_COPY;
+    if (r.len >= FLAT_TRACK_MIN) {
+      if (ppu) {
+	r.kind = FLAT_PPU;
+      } else if (mapper) {
+	// By convention, these are CHR RAM and extra nametables,
+	// which the mapper doesn't write to itself.
+	const bool ppuonly = sf->desc != NULL &&
+	  (!strcmp(sf->desc, "CHRR") || !strcmp(sf->desc, "EXNR"));
+	r.kind = ppuonly ? FLAT_PPU : FLAT_CART;
+      }
+    }
+    r.dirty = true;
+    r.fingerprint = 0;
+    if (r.len > 0) {
+      if (r.kind != FLAT_COPY) flat_tracked.push_back(flat_plan.size());
+      flat_plan.push_back(r);
+      flat_data_size += r.len;
+    }
+    sf++;
+  }
+}
+
+static void MakeFlatPlan() {
+  flat_plan.clear();
+  flat_tracked.clear();
+  flat_data_size = 0;
+  AddFlatRegions(SFCPU, false, false);
+  AddFlatRegions(SFCPUC, false, false);
+  AddFlatRegions(FCEUPPU_STATEINFO, true, false);
+  AddFlatRegions(FCEU_NEWPPU_STATEINFO, true, false);
+  AddFlatRegions(FCEUCTRL_STATEINFO, false, false);
+  AddFlatRegions(FCEUSND_STATEINFO, false, false);
+  flat_mapper_start = flat_plan.size();
+  AddFlatRegions(SFMDATA, false, true);
+  flat_size = flat_data_size + flat_tracked.size() * sizeof (uint64);
+  flat_plan_ok = true;
+}
+
+static inline uint8 *FlatRegionPtr(const FlatRegion &r) {
+  return r.indirect ? *(uint8 **)r.v : (uint8 *)r.v;
+}
+
+// Not a cryptographic hash, but mixes every word, so that differing
+// contents get the same fingerprint with negligible probability.
+static uint64 Fingerprint(const uint8 *data, uint32 len) {
+  const uint64 k1 = 0x9E3779B97F4A7C15ULL, k2 = 0xC2B2AE3D27D4EB4FULL;
+  uint64 h = len * k1;
+  while (len >= 8) {
+    uint64 w;
+    memcpy(&w, data, 8);
+    h ^= w * k2;
+    h = ((h << 31) | (h >> 33)) * k1;
+    data += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    h ^= *data * k2;
+    h = ((h << 31) | (h >> 33)) * k1;
+    data++;
+    len--;
+  }
+  h ^= h >> 29;
+  h *= k2;
+  h ^= h >> 32;
+  return h;
+}
+
+// Accounts for CPU writes to the cartridge since the last flat save
+// or load.
+static void FoldCartDirty() {
+  if (FCEUSS_cart_dirty) {
+    for (int i = 0; i < flat_tracked.size(); i++) {
+      FlatRegion *r = &flat_plan[flat_tracked[i]];
+      if (r->kind == FLAT_CART) r->dirty = true;
+    }
+    FCEUSS_cart_dirty = false;
+  }
+}
+
+void FCEUSS_MarkDirty(const uint8 *p) {
+  for (int i = 0; i < flat_tracked.size(); i++) {
+    FlatRegion *r = &flat_plan[flat_tracked[i]];
+    const uint8 *start = FlatRegionPtr(*r);
+    if (p >= start && p < start + r->len) {
+      r->dirty = true;
+      return;
+    }
+  }
+}
+
+void FCEUSS_DirtyAll() {
+  for (int i = 0; i < flat_tracked.size(); i++)
+    flat_plan[flat_tracked[i]].dirty = true;
+  FCEUSS_cart_dirty = true;
+}
+
+bool FCEUSS_SaveFlat(std::vector<uint8> *out) {
+  if (!flat_plan_ok) MakeFlatPlan();
+  FoldCartDirty();
+
+  FCEUPPU_SaveState();
+  FCEUSND_SaveState();
+
+  out->resize(flat_size);
+  uint8 *dest = flat_size > 0 ? &(*out)[0] : NULL;
+  uint8 *fingerprints = dest + flat_data_size;
+  for (int i = 0; i < flat_plan.size(); i++) {
+    if (i == flat_mapper_start && SPreSave) SPreSave();
+    FlatRegion &r = flat_plan[i];
+    const uint8 *src = FlatRegionPtr(r);
+    memcpy(dest, src, r.len);
+    dest += r.len;
+    if (r.kind != FLAT_COPY) {
+      if (r.dirty) {
+	r.fingerprint = Fingerprint(src, r.len);
+	r.dirty = false;
+      }
+      memcpy(fingerprints, &r.fingerprint, sizeof (uint64));
+      fingerprints += sizeof (uint64);
+    }
+  }
+  if (flat_mapper_start == flat_plan.size() && SPreSave) SPreSave();
+  if (SPreSave) {
+    SPostSave();
+    // The hooks may have changed what we just fingerprinted.
+    for (int i = flat_mapper_start; i < flat_plan.size(); i++)
+      flat_plan[i].dirty = true;
+  }
+
+  return true;
+}
+
+bool FCEUSS_LoadFlat(std::vector<uint8> *in) {
+  if (!flat_plan_ok) MakeFlatPlan();
+
+  if (in->size() != flat_size) {
+    FCEUD_PrintError("flat savestate is the wrong size");
+    return false;
+  }
+
+  FoldCartDirty();
+
+  // Assume current version; memory only.
+  int stateversion = FCEU_VERSION_NUMERIC;
+
+  FCEUMOV_PreLoad();
+
+  const uint8 *src = flat_size > 0 ? &(*in)[0] : NULL;
+  const uint8 *fingerprints = src + flat_data_size;
+  for (int i = 0; i < flat_plan.size(); i++) {
+    FlatRegion &r = flat_plan[i];
+    if (r.kind == FLAT_COPY) {
+      memcpy(FlatRegionPtr(r), src, r.len);
+    } else {
+      uint64 fingerprint;
+      memcpy(&fingerprint, fingerprints, sizeof (uint64));
+      fingerprints += sizeof (uint64);
+      if (r.dirty || r.fingerprint != fingerprint) {
+	memcpy(FlatRegionPtr(r), src, r.len);
+	r.fingerprint = fingerprint;
+	r.dirty = false;
+      }
+    }
+    src += r.len;
+  }
+
+  // What ReadStateChunks does when the sound chunk is present,
+  // which it always is for us.
+  extern int resetDMCacc;
+  resetDMCacc = 0;
+
+  if(GameStateRestore) {
+    GameStateRestore(stateversion);
+  }
+
+  FCEUPPU_LoadState(stateversion);
+  FCEUSND_LoadState(stateversion);
+  return FCEUMOV_PostLoad();
+}
+
 bool FCEUSS_LoadRAW(std::vector<uint8> *in) {
   EMUFILE_MEMORY is(in);
 
@@ -758,6 +1035,7 @@ void ResetExState(void (*PreSave)(void), void (*PostSave)(void))
 	SPreSave = PreSave;
 	SPostSave = PostSave;
 	SFEXINDEX=0;
+	flat_plan_ok = false;
 }
 
 void AddExState(void *v, uint32 s, int type, char *desc) {
@@ -803,6 +1081,7 @@ void AddExState(void *v, uint32 s, int type, char *desc) {
     }
   }
   SFMDATA[SFEXINDEX].v=0;		// End marker.
+  flat_plan_ok = false;
 }
 
 void FCEUI_SelectStateNext(int n)
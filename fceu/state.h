@@ -57,6 +57,28 @@ struct SFORMAT
 // Tom 7's simplified versions. These should only be used for in-memory saves!
 bool FCEUSS_SaveRAW(std::vector<uint8> *out);
 bool FCEUSS_LoadRAW(std::vector<uint8> *in);
+// Even simpler: the same data as SaveRAW, copied into a buffer of a
+// fixed size with no tags or byte swapping. Only good for loading
+// into the same build running the same game, but much faster.
+bool FCEUSS_SaveFlat(std::vector<uint8> *out);
+bool FCEUSS_LoadFlat(std::vector<uint8> *in);
+// Flat loads skip large regions (nametable, CHR and work RAM) that
+// haven't been written since the last flat save or load and already
+// hold the saved contents, so they need to hear about writes to them.
+// The PPU calls FCEUSS_MarkDirty with the address of each byte it
+// writes to video memory; the CPU sets FCEUSS_cart_dirty when it
+// writes anywhere the cartridge might keep RAM. Anything else that
+// changes these regions behind their backs (power, reset, other kinds
+// of loads) calls FCEUSS_DirtyAll.
+void FCEUSS_MarkDirty(const uint8 *p);
+extern bool FCEUSS_cart_dirty;
+void FCEUSS_DirtyAll();
+// Calls visit on each region of memory that FCEUSS_SaveRAW saves, in
+// the same order, without copying anything. The data are in native
+// byte order (no RLSB flipping) and there are no tags, so this is
+// only good for things like hashing the current state.
+void FCEUSS_VisitRAW(void (*visit)(void *arg, const uint8 *data, uint32 len),
+                     void *arg);
 
 void ResetExState(void (*PreSave)(void),void (*PostSave)(void));
 void AddExState(void *v, uint32 s, int type, char *desc);
@@ -24,6 +24,7 @@
 #include "fceu.h"
 #include "debug.h"
 #include "sound.h"
+#include "state.h"
 #ifdef _S9XLUA_H
 #include "fceulua.h"
 #endif
@@ -50,6 +51,8 @@ static INLINE uint8 RdMem(unsigned int A)
 //normal memory write
 static INLINE void WrMem(unsigned int A, uint8 V)
 {
+	// The cartridge may have written to its RAM.
+	if(A>=0x4020) FCEUSS_cart_dirty=true;
 	BWrite[A](A,V);
 	#ifdef _S9XLUA_H
 	CallRegisteredLuaMemHook(A, 1, V, LUAMEMHOOK_WRITE);
@@ -80,6 +83,7 @@ uint8 X6502_DMR(uint32 A)
 void X6502_DMW(uint32 A, uint8 V)
 {
  ADDCYC(1);
+ if(A>=0x4020) FCEUSS_cart_dirty=true;
  BWrite[A](A,V);
  #ifdef _S9XLUA_H
  CallRegisteredLuaMemHook(A, 1, V, LUAMEMHOOK_WRITE);
@@ -27,7 +27,9 @@
 #include "objective.h"
 #include "weighted-objectives.h"
 #include "motifs.h"
+#include "markov.h"
 #include "game.h"
+#include "worker-pool.h"
 
 #ifdef MARIONET
 #include "SDL.h"
@@ -36,10 +38,7 @@
 
 static void SaveMemory(vector< vector<uint8> > *memories) {
   memories->resize(memories->size() + 1);
-  vector<uint8> *v = &memories->back();
-  for (int i = 0; i < 0x800; i++) {
-    v->push_back((uint8)RAM[i]);
-  }
+  Emulator::GetMemory(&memories->back());
 }
 
 static vector< vector<int> > *objectives = NULL;
@@ -52,11 +51,105 @@ static void PrintAndSave(const vector<int> &ordering) {
   objectives->push_back(ordering);
 }
 
+// Number of worker processes to enumerate objectives on.
+static int num_workers = 0;
+
+// A call to Objective::EnumerateFull, or EnumerateFullAll if all is
+// true, to be run on a worker. The header (if any) is printed before
+// the objectives it finds.
+struct EnumerateJob {
+  EnumerateJob(bool all, const vector<int> &look, int limit, int seed,
+	       const string &header) :
+    all(all), look(look), limit(limit), seed(seed), header(header) {}
+  bool all;
+  vector<int> look;
+  int limit, seed;
+  string header;
+};
+
+// Where the worker collects the objectives for the current job.
+static vector< vector<int> > *found = NULL;
+static void Save(const vector<int> &ordering) {
+  found->push_back(ordering);
+}
+
+// Runs EnumerateJobs in the worker processes, which are forked after
+// the memories are recorded, so they share them.
+struct Enumerator : public WorkerPool::Worker {
+  explicit Enumerator(Objective *obj) : obj(obj) {}
+
+  void DoWork(const string &request, string *response) {
+    WorkerPool::Reader r(request);
+    const bool all = r.Int();
+    const int limit = r.Int();
+    const int seed = r.Int();
+    vector<int> look(r.Int());
+    for (int i = 0; i < look.size(); i++) look[i] = r.Int();
+    CHECK(r.Done());
+
+    vector< vector<int> > orderings;
+    found = &orderings;
+    if (all) {
+      obj->EnumerateFullAll(Save, limit, seed);
+    } else {
+      obj->EnumerateFull(look, Save, limit, seed);
+    }
+    found = NULL;
+
+    WorkerPool::Writer w(response);
+    w.Int(orderings.size());
+    for (int i = 0; i < orderings.size(); i++) {
+      w.Int(orderings[i].size());
+      for (int j = 0; j < orderings[i].size(); j++) {
+	w.Int(orderings[i][j]);
+      }
+    }
+  }
+
+  Objective *obj;
+};
+
+// Runs the jobs in parallel, then prints and saves their objectives
+// in the order of the jobs, so that the result is the same as running
+// them one after another.
+static void RunJobs(const vector<EnumerateJob> &jobs, Objective *obj) {
+  vector<string> requests, responses;
+  requests.resize(jobs.size());
+  for (int i = 0; i < jobs.size(); i++) {
+    WorkerPool::Writer w(&requests[i]);
+    w.Int(jobs[i].all);
+    w.Int(jobs[i].limit);
+    w.Int(jobs[i].seed);
+    w.Int(jobs[i].look.size());
+    for (int j = 0; j < jobs[i].look.size(); j++) {
+      w.Int(jobs[i].look[j]);
+    }
+  }
+
+  {
+    Enumerator enumerator(obj);
+    WorkerPool workers(num_workers, &enumerator);
+    workers.RunAll(requests, &responses);
+  }
+
+  for (int i = 0; i < jobs.size(); i++) {
+    if (!jobs[i].header.empty()) printf("%s", jobs[i].header.c_str());
+    WorkerPool::Reader r(responses[i]);
+    const int num = r.Int();
+    for (int j = 0; j < num; j++) {
+      vector<int> ordering(r.Int());
+      for (int k = 0; k < ordering.size(); k++) ordering[k] = r.Int();
+      PrintAndSave(ordering);
+    }
+    CHECK(r.Done());
+  }
+}
+
 // With e.g. an divisor of 3, generate slices covering
 // the first third, middle third, and last third.
 static void GenerateNthSlices(int divisor, int num, 
 			      const vector< vector<uint8> > &memories,
-			      Objective *obj) {
+			      vector<EnumerateJob> *jobs) {
   const int onenth = memories.size() / divisor;
   for (int slicenum = 0; slicenum < divisor; slicenum++) {
     vector<int> look;
@@ -64,25 +157,29 @@ static void GenerateNthSlices(int divisor, int num,
     for (int i = 0; i < onenth; i++) {
       look.push_back(low + i);
     }
-    printf("For slice %ld-%ld:\n", low, low + onenth - 1);
+    string header = StringPrintf("For slice %d-%d:\n",
+				 low, low + onenth - 1);
     for (int i = 0; i < num; i++) {
-      obj->EnumerateFull(look, PrintAndSave, 1, slicenum * 0xBEAD + i);
+      jobs->push_back(EnumerateJob(false, look, 1, slicenum * 0xBEAD + i,
+				   i == 0 ? header : ""));
     }
   }
 }
 
 static void GenerateOccasional(int stride, int offsets, int num,
 			       const vector< vector<uint8> > &memories,
-			       Objective *obj) {
+			       vector<EnumerateJob> *jobs) {
   for (int off = 0; off < offsets; off++) {
     vector<int> look;
     // Consider starting at various places throughout the first stide?
     for (int start = off; start < memories.size(); start += stride) {
       look.push_back(start);
     }
-    printf("For occasional @%d (every %d):\n", off, stride);
+    string header = StringPrintf("For occasional @%d (every %d):\n",
+				 off, stride);
     for (int i = 0; i < num; i++) {
-      obj->EnumerateFull(look, PrintAndSave, 1, off * 0xF00D + i);
+      jobs->push_back(EnumerateJob(false, look, 1, off * 0xF00D + i,
+				   i == 0 ? header : ""));
     }
   }
 }
@@ -97,31 +194,34 @@ static void MakeObjectives(const vector< vector<uint8> > &memories) {
   // [world number, stage number] or [score]. So generate
   // a handful of whole-game objectives.
 
-  // TODO: In Mario, all 50 appear to be effectively the same
-  // when graphed. Are they all equivalent, and should we be
-  // accounting for that e.g. in weighting or deduplication?
+  // In Mario, all 50 appear to be effectively the same when
+  // graphed. The ones that really are equivalent get merged after
+  // weighting, below.
+  vector<EnumerateJob> jobs;
   for (int i = 0; i < 50; i++) // was 10
-    obj.EnumerateFullAll(PrintAndSave, 1, i);
+    jobs.push_back(EnumerateJob(true, vector<int>(), 1, i, ""));
 
   // XXX Not sure how I feel about these, based on the
   // graphics. They are VERY noisy.
 
   // Next, generate objectives for each tenth of the game.
-  GenerateNthSlices(10, 3, memories, &obj);
+  GenerateNthSlices(10, 3, memories, &jobs);
 
   // And for each 1/100th.
-  // GenerateNthSlices(100, 1, memories, &obj);
+  // GenerateNthSlices(100, 1, memories, &jobs);
 
   // Now, for individual frames spread throughout the
   // whole movie.
   // This one looks great.
-  GenerateOccasional(100, 10, 10, memories, &obj);
+  GenerateOccasional(100, 10, 10, memories, &jobs);
   // was 5,2
 
-  GenerateOccasional(250, 10, 10, memories, &obj);
+  GenerateOccasional(250, 10, 10, memories, &jobs);
 
   // This one looks okay; noisy at times.
-  GenerateOccasional(1000, 10, 1, memories, &obj);
+  GenerateOccasional(1000, 10, 1, memories, &jobs);
+
+  RunJobs(jobs, &obj);
 
   // Weight them. Currently this is just removing duplicates.
   printf("There are %d objectives\n", objectives->size());
@@ -129,6 +229,11 @@ static void MakeObjectives(const vector< vector<uint8> > &memories) {
   printf("And %d example memories\n", memories.size());
   weighted.WeightByExamples(memories);
   printf("And %d unique objectives\n", weighted.Size());
+  // Many of them, like most of the 50 whole-game ones, behave the
+  // same on the memories.
+  const int num_merged = weighted.MergeEquivalent(memories);
+  printf("Merged %d equivalent objectives, leaving %d\n",
+	 num_merged, (int)weighted.Size());
 
   weighted.SaveToFile(GAME ".objectives");
 
@@ -136,6 +241,16 @@ static void MakeObjectives(const vector< vector<uint8> > &memories) {
 }
 
 int main(int argc, char *argv[]) {
+  num_workers = WorkerPool::NumProcessors();
+  if (argc >= 2) {
+    if (0 == strcmp(argv[1], "--workers") && argc >= 3 && atoi(argv[2]) > 0) {
+      num_workers = atoi(argv[2]);
+    } else {
+      fprintf(stderr, "Usage: learnfun [--workers N]\n");
+      abort();
+    }
+  }
+
   Emulator::Initialize(GAME ".nes");
   vector<uint8> movie = SimpleFM2::ReadInputs(MOVIE);
   CHECK(!movie.empty());
@@ -185,13 +300,18 @@ int main(int argc, char *argv[]) {
   uint64 time_end = time(NULL);
 
   printf("Recorded %ld memories in %ld sec.\n", 
-         memories.size(),
-         time_end - time_start);
+	 memories.size(),
+	 time_end - time_start);
 
   MakeObjectives(memories);
   Motifs motifs;
   motifs.AddInputs(inputs);
   motifs.SaveToFile(GAME ".motifs");
+  // A few inputs of context, which is enough to capture how long
+  // buttons are held and what follows what.
+  Markov markov(3);
+  markov.AddInputs(inputs);
+  markov.SaveToFile(GAME ".markov");
 
   Emulator::Shutdown();
 
@@ -0,0 +1,165 @@
+#include "markov.h"
+
+#include <string>
+#include <sstream>
+
+#include "tasbot.h"
+#include "../cc-lib/arcfour.h"
+#include "../cc-lib/util.h"
+#include "util.h"
+
+Markov::Markov(int order) : order(order) {
+  CHECK(order >= 0 && order <= MAX_ORDER);
+}
+
+uint64 Markov::Mask(int len) {
+  return len == 8 ? ~0ULL : (1ULL << (8 * len)) - 1ULL;
+}
+
+Markov *Markov::LoadFromFile(const string &filename) {
+  vector<string> lines = Util::ReadFileToLines(filename);
+  if (lines.empty()) return NULL;
+
+  // The first line is the order, and the rest are the counts, each
+  // followed by the context (oldest input first) and the input.
+  Markov *mm = new Markov(atoi(lines[0].c_str()));
+  for (int i = 1; i < lines.size(); i++) {
+    stringstream ss(lines[i], stringstream::in);
+    vector<int> fields;
+    int f;
+    while (ss >> f) fields.push_back(f);
+    if (fields.empty()) continue;
+    CHECK(fields.size() == mm->order + 2);
+
+    uint64 context = 0ULL;
+    for (int j = 0; j < mm->order; j++) {
+      context = (context << 8) | (uint8)fields[1 + j];
+    }
+    mm->counts[make_pair(context, (uint8)fields.back())] += fields[0];
+  }
+
+  mm->Compile();
+  return mm;
+}
+
+void Markov::SaveToFile(const string &filename) const {
+  string out = StringPrintf("%d\n", order);
+  for (Counts::const_iterator it = counts.begin();
+       it != counts.end(); ++it) {
+    out += StringPrintf("%d", it->second);
+    for (int j = order - 1; j >= 0; j--) {
+      out += StringPrintf(" %d", (int)((it->first.first >> (8 * j)) & 0xFF));
+    }
+    out += StringPrintf(" %d\n", it->first.second);
+  }
+  printf("Wrote %d transitions to %s.\n", (int)counts.size(),
+	 filename.c_str());
+  Util::WriteFile(filename, out);
+}
+
+void Markov::AddInputs(const vector<uint8> &inputs) {
+  // Inputs before the first full context are only seen as
+  // contexts, not as transitions.
+  uint64 context = 0ULL;
+  for (int i = 0; i < inputs.size(); i++) {
+    if (i >= order) {
+      counts[make_pair(context & Mask(order), inputs[i])]++;
+    }
+    context = (context << 8) | inputs[i];
+  }
+
+  Compile();
+}
+
+void Markov::Compile() {
+  // Inputs that followed each context of each length, and the
+  // context and length of each state, which are numbered in order.
+  vector<Counts> shorter(order + 1);
+  vector< pair<uint64, int> > contexts;
+  states.clear();
+  states.resize(order + 1);
+  for (int len = 0; len <= order; len++) {
+    // The shorter contexts are the suffixes of the full ones.
+    for (Counts::const_iterator it = counts.begin();
+	 it != counts.end(); ++it) {
+      shorter[len][make_pair(it->first.first & Mask(len),
+			     it->first.second)] += it->second;
+    }
+
+    for (Counts::const_iterator it = shorter[len].begin();
+	 it != shorter[len].end(); ++it) {
+      const uint64 context = it->first.first;
+      if (states[len].find(context) == states[len].end()) {
+	states[len][context] = contexts.size();
+	contexts.push_back(make_pair(context, len));
+      }
+    }
+  }
+
+  // Now that all the states exist, the choices. The counts for
+  // each state are together, since they're in order.
+  choices.clear();
+  starts.clear();
+  for (int s = 0; s < contexts.size(); s++) {
+    const uint64 context = contexts[s].first;
+    const int len = contexts[s].second;
+    starts.push_back(choices.size());
+    for (Counts::const_iterator it =
+	   shorter[len].lower_bound(make_pair(context, (uint8)0));
+	 it != shorter[len].end() && it->first.first == context; ++it) {
+      Choice choice;
+      choice.input = it->first.second;
+      choice.next = Lookup((context << 8) | choice.input,
+			   min(len + 1, order));
+      choices.insert(choices.end(), it->second, choice);
+    }
+  }
+  starts.push_back(choices.size());
+}
+
+int Markov::Lookup(uint64 context, int len) const {
+  // Back off to shorter contexts until we find one that was seen.
+  // If any were, the empty context was.
+  for (int l = len; l >= 0; l--) {
+    unordered_map<uint64, int>::const_iterator it =
+      states[l].find(context & Mask(l));
+    if (it != states[l].end()) return it->second;
+  }
+  CHECK(!"no inputs in the model");
+  return -1;
+}
+
+// Uniform in [0, n). For small n, this usually takes a single byte
+// of randomness.
+static int RandomBelow(ArcFour *rc, int n) {
+  if (n <= 256) {
+    const int limit = 256 - 256 % n;
+    for (;;) {
+      const int b = rc->Byte();
+      if (b < limit) return b % n;
+    }
+  }
+  return RandomInt32(rc) % n;
+}
+
+void Markov::Extend(ArcFour *rc, int len, vector<uint8> *inputs) const {
+  // Context from the inputs already there.
+  uint64 context = 0ULL;
+  int have = 0;
+  for (int i = max(0, (int)inputs->size() - order);
+       i < inputs->size(); i++) {
+    context = (context << 8) | (*inputs)[i];
+    have++;
+  }
+
+  int state = Lookup(context, have);
+  inputs->reserve(len);
+  while (inputs->size() < len) {
+    const int start = starts[state];
+    const int num = starts[state + 1] - start;
+    const Choice &choice =
+      choices[num == 1 ? start : start + RandomBelow(rc, num)];
+    inputs->push_back(choice.input);
+    state = choice.next;
+  }
+}
@@ -0,0 +1,83 @@
+/* A Markov model of inputs, learned from a movie. Each input is
+   sampled given the few inputs before it, in proportion to how often
+   it followed them in the movie. This is an alternative to gluing
+   together motifs for generating futures: sampling takes constant
+   time per input, and the sequences have the movie's transitions
+   rather than fixed 10-input chunks. */
+
+#ifndef __MARKOV_H
+#define __MARKOV_H
+
+#include <vector>
+#include <map>
+#include <string>
+#include <utility>
+#ifdef __GNUC__
+#include <tr1/unordered_map>
+using std::tr1::unordered_map;
+#else
+#include <unordered_map>
+#endif
+
+#include "tasbot.h"
+#include "../cc-lib/arcfour.h"
+
+struct Markov {
+  // Each input depends on the order inputs before it, which is at
+  // most MAX_ORDER.
+  explicit Markov(int order);
+
+  static Markov *LoadFromFile(const std::string &filename);
+  void SaveToFile(const std::string &filename) const;
+
+  // Learn the transitions in the inputs, which are a movie.
+  void AddInputs(const vector<uint8> &inputs);
+
+  int Order() const { return order; }
+
+  // Appends inputs until there are len, each sampled given the ones
+  // before it (which may have been there already). When those were
+  // never seen, including when there are fewer than the order, uses
+  // as many of the most recent as were. Constant time per input.
+  void Extend(ArcFour *rc, int len, vector<uint8> *inputs) const;
+
+  static const int MAX_ORDER = 8;
+
+ private:
+  // Contexts are packed into 64 bits, a byte per input, with the
+  // most recent in the low byte.
+  static uint64 Mask(int len);
+
+  // Number of times each input followed each context of order inputs.
+  typedef std::map< std::pair<uint64, uint8>, int > Counts;
+  Counts counts;
+  const int order;
+
+  // Rebuilds the state machine below from counts.
+  void Compile();
+
+  // The model as a state machine. A state is a context (of any
+  // length up to the order) that was seen followed by something, and
+  // the current state is the longest one that the inputs end with.
+  // Each state has the inputs that followed it, each repeated as many
+  // times as it did, so that choosing one uniformly samples the
+  // transition. Each choice also has the state it leads to.
+  struct Choice {
+    uint8 input;
+    int next;
+  };
+  // State s's choices are choices[starts[s]] up to choices[starts[s + 1]].
+  vector<Choice> choices;
+  vector<int> starts;
+  // For each length from 0 to order, the states for the contexts
+  // of that length.
+  vector< unordered_map<uint64, int> > states;
+
+  // The state for the longest seen suffix of the context, which
+  // has len inputs.
+  int Lookup(uint64 context, int len) const;
+
+  NOT_COPYABLE(Markov);
+};
+
+#endif
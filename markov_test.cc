@@ -0,0 +1,181 @@
+/* Tests for the Markov model of inputs. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "tasbot.h"
+#include "fceu/types.h"
+#include "../cc-lib/util.h"
+#include "../cc-lib/arcfour.h"
+#include "markov.h"
+#include "util.h"
+
+static const uint8 A = 1, B = 2, C = 3, Z = 99;
+
+// A B A B A B A C, repeated. So A is followed by B three times as
+// often as by C, B and C are always followed by A, and C A is always
+// followed by B.
+static vector<uint8> Movie() {
+  static const uint8 kPattern[] = { A, B, A, B, A, B, A, C };
+  vector<uint8> movie;
+  for (int i = 0; i < 100; i++) {
+    movie.insert(movie.end(), kPattern, kPattern + 8);
+  }
+  return movie;
+}
+
+// Extends the context by one input many times, and returns the
+// fraction of times that it was each input.
+static vector<double> Frequencies(const Markov &m, ArcFour *rc,
+				  const vector<uint8> &context) {
+  static const int TRIALS = 20000;
+  vector<int> counts(256, 0);
+  for (int t = 0; t < TRIALS; t++) {
+    vector<uint8> inputs = context;
+    m.Extend(rc, context.size() + 1, &inputs);
+    CHECK(inputs.size() == context.size() + 1);
+    CHECK(vector<uint8>(inputs.begin(), inputs.end() - 1) == context);
+    counts[inputs.back()]++;
+  }
+
+  vector<double> freqs;
+  for (int i = 0; i < counts.size(); i++) {
+    freqs.push_back((double)counts[i] / TRIALS);
+  }
+  return freqs;
+}
+
+static void CheckNear(const char *what, double actual, double expected) {
+  if (fabs(actual - expected) > 0.02) {
+    fprintf(stderr, "%s: got %f but expected about %f\n",
+	    what, actual, expected);
+    abort();
+  }
+}
+
+static vector<uint8> Inputs(uint8 a, int b = -1) {
+  vector<uint8> v(1, a);
+  if (b >= 0) v.push_back(b);
+  return v;
+}
+
+static void TestFrequencies() {
+  ArcFour rc("frequencies");
+  Markov m(1);
+  m.AddInputs(Movie());
+
+  vector<double> f = Frequencies(m, &rc, Inputs(A));
+  CheckNear("B after A", f[B], 0.75);
+  CheckNear("C after A", f[C], 0.25);
+  CHECK(f[A] == 0.0);
+
+  CHECK(Frequencies(m, &rc, Inputs(B))[A] == 1.0);
+  CHECK(Frequencies(m, &rc, Inputs(C))[A] == 1.0);
+
+  // Longer sequences only have transitions that were in the movie.
+  vector<uint8> inputs = Inputs(B);
+  m.Extend(&rc, 1000, &inputs);
+  CHECK(inputs.size() == 1000);
+  for (int i = 1; i < inputs.size(); i++) {
+    if (inputs[i - 1] == A) {
+      CHECK(inputs[i] == B || inputs[i] == C);
+    } else {
+      CHECK(inputs[i] == A);
+    }
+  }
+  fprintf(stderr, "Frequencies OK.\n");
+}
+
+static void TestBackOff() {
+  ArcFour rc("backoff");
+  Markov m(2);
+  m.AddInputs(Movie());
+
+  // The whole context was seen.
+  CHECK(Frequencies(m, &rc, Inputs(C, A))[B] == 1.0);
+  CHECK(Frequencies(m, &rc, Inputs(A, C))[A] == 1.0);
+
+  // Z A was never seen, so it's the same as just A. The first
+  // A B in the movie isn't a transition, since it has no context.
+  vector<double> f = Frequencies(m, &rc, Inputs(Z, A));
+  CheckNear("B after Z A", f[B], 299.0 / 399.0);
+  CheckNear("C after Z A", f[C], 100.0 / 399.0);
+
+  // Shorter than the order.
+  f = Frequencies(m, &rc, Inputs(A));
+  CheckNear("B after A", f[B], 299.0 / 399.0);
+
+  // Nothing seen at all, so the input frequencies. Those are the
+  // inputs of the transitions, which is all but the first two.
+  const double total = 800 - 2;
+  f = Frequencies(m, &rc, Inputs(Z));
+  CheckNear("A after Z", f[A], 399.0 / total);
+  CheckNear("B after Z", f[B], 299.0 / total);
+  CheckNear("C after Z", f[C], 100.0 / total);
+  f = Frequencies(m, &rc, vector<uint8>());
+  CheckNear("A first", f[A], 399.0 / total);
+  CHECK(f[Z] == 0.0);
+  fprintf(stderr, "BackOff OK.\n");
+}
+
+static void TestOrderZero() {
+  ArcFour rc("orderzero");
+  Markov m(0);
+  m.AddInputs(Movie());
+
+  // Every input is a transition, and the context doesn't matter.
+  for (int c = 0; c < 3; c++) {
+    const vector<uint8> context =
+      c == 0 ? vector<uint8>() : c == 1 ? Inputs(A) : Inputs(C, C);
+    vector<double> f = Frequencies(m, &rc, context);
+    CheckNear("A", f[A], 0.5);
+    CheckNear("B", f[B], 0.375);
+    CheckNear("C", f[C], 0.125);
+  }
+  fprintf(stderr, "OrderZero OK.\n");
+}
+
+static void TestSaveLoad() {
+  for (int order = 0; order <= 3; order++) {
+    Markov m(order);
+    m.AddInputs(Movie());
+    vector<uint8> more = Inputs(C, C);
+    more.push_back(B);
+    more.push_back(Z);
+    m.AddInputs(more);
+
+    const string filename = "markov_test.markov";
+    m.SaveToFile(filename);
+    Markov *loaded = Markov::LoadFromFile(filename);
+    CHECK(loaded != NULL);
+    CHECK(loaded->Order() == order);
+
+    // Same file when saved again.
+    const string contents = Util::ReadFile(filename);
+    loaded->SaveToFile(filename);
+    CHECK(Util::ReadFile(filename) == contents);
+
+    // Same samples with the same randomness.
+    ArcFour rc1("saveload"), rc2("saveload");
+    vector<uint8> a, b;
+    m.Extend(&rc1, 2000, &a);
+    loaded->Extend(&rc2, 2000, &b);
+    CHECK(a == b);
+
+    delete loaded;
+    unlink(filename.c_str());
+  }
+  fprintf(stderr, "SaveLoad OK.\n");
+}
+
+int main(int argc, char *argv[]) {
+  TestFrequencies();
+  TestBackOff();
+  TestOrderZero();
+  TestSaveLoad();
+  fprintf(stderr, "SUCCESS.\n");
+  return 0;
+}
@@ -1,6 +1,7 @@
 
 #include "motifs.h"
 
+#include <string.h>
 #include <algorithm>
 #include <set>
 #include <string>
@@ -13,8 +14,9 @@
 #include "../cc-lib/util.h"
 #include "simplefm2.h"
 #include "motifs-style.h"
+#include "../cc-lib/city/city.h"
 
-Motifs::Motifs() : rc("motifs") {}
+Motifs::Motifs() : updates(0), rc("motifs") {}
 
 static string InputsToString(const vector<uint8> &inputs) {
   string s;
@@ -26,23 +28,118 @@ static string InputsToString(const vector<uint8> &inputs) {
   return s;
 }
 
-void Motifs::Pick(const vector<uint8> &inputs) {
-  Weighted::iterator it = motifs.find(inputs);
-  if (it == motifs.end()) return;
-  else it->second.picked++;
+void Motifs::Pick(int id) {
+  infos[id].picked++;
 }
 
-bool Motifs::IsMotif(const vector<uint8> &inputs) {
-  return motifs.find(inputs) != motifs.end();
+uint64 Motifs::HashInputs(const uint8 *inputs, int len) {
+  return CityHash64((const char *)inputs, len);
+}
+
+int Motifs::FindSlot(const uint8 *in, int len) const {
+  const int mask = table.size() - 1;
+  for (int slot = HashInputs(in, len) & mask; ; slot = (slot + 1) & mask) {
+    const int id = table[slot];
+    if (id < 0 ||
+	(Length(id) == len && 0 == memcmp(Inputs(id), in, len))) {
+      return slot;
+    }
+  }
+}
+
+int Motifs::GetId(const vector<uint8> &in) const {
+  if (table.empty()) return -1;
+  return table[FindSlot(in.empty() ? NULL : &in[0], in.size())];
+}
+
+vector<uint8> Motifs::GetInputs(int id) const {
+  return vector<uint8>(Inputs(id), Inputs(id) + Length(id));
+}
+
+int Motifs::AddMotif(const vector<uint8> &in) {
+  const int id = GetId(in);
+  if (id >= 0) return id;
+
+  if (starts.empty()) starts.push_back(0);
+  arena.insert(arena.end(), in.begin(), in.end());
+  starts.push_back(arena.size());
+  infos.push_back(Info());
+
+  // Keep the table at most half full.
+  if (table.size() < 2 * infos.size()) {
+    vector<int> bigger(max((size_t)16, table.size() * 2), -1);
+    table.swap(bigger);
+    for (int i = 0; i < infos.size(); i++) {
+      table[FindSlot(Inputs(i), Length(i))] = i;
+    }
+  } else {
+    table[FindSlot(in.empty() ? NULL : &in[0], in.size())] =
+      infos.size() - 1;
+  }
+  return infos.size() - 1;
+}
+
+struct Motifs::IdLess {
+  explicit IdLess(const Motifs *m) : m(m) {}
+  bool operator ()(int a, int b) const {
+    return std::lexicographical_compare(m->Inputs(a),
+					m->Inputs(a) + m->Length(a),
+					m->Inputs(b),
+					m->Inputs(b) + m->Length(b));
+  }
+  const Motifs *m;
+};
+
+vector<int> Motifs::SortedIds() const {
+  vector<int> ids;
+  for (int i = 0; i < infos.size(); i++) ids.push_back(i);
+  std::sort(ids.begin(), ids.end(), IdLess(this));
+  return ids;
+}
+
+void Motifs::BuildTree() {
+  const int n = infos.size();
+  tree.resize(n + 1);
+  for (int i = 1; i <= n; i++) tree[i] = infos[i - 1].weight;
+  // Each node adds itself into its parent.
+  for (int i = 1; i <= n; i++) {
+    int parent = i + (i & -i);
+    if (parent <= n) tree[parent] += tree[i];
+  }
+  updates = 0;
+}
+
+double Motifs::PrefixWeight(int n) const {
+  double sum = 0.0;
+  for (int i = n; i > 0; i -= i & -i) sum += tree[i];
+  return sum;
+}
+
+int Motifs::FindWeight(double sample) const {
+  const int n = infos.size();
+  int high = 1;
+  while (high * 2 <= n) high *= 2;
+
+  // Find the most motifs whose weights sum to less than the sample;
+  // the next one is where it's reached. Same as subtracting each
+  // weight from the sample in order until it's no more than the
+  // weight, except for floating point roundoff.
+  int pos = 0;
+  for (int step = high; step > 0; step >>= 1) {
+    if (pos + step <= n && tree[pos + step] < sample) {
+      pos += step;
+      sample -= tree[pos];
+    }
+  }
+  return pos;
 }
 
 void Motifs::Checkpoint(int framenum) {
   // PERF could maybe just remove spans here, which makes
   // printing much simpler and this data structure more
   // compact!
-  for (Weighted::iterator it = motifs.begin(); 
-       it != motifs.end(); ++it) {
-    it->second.history.push_back(make_pair(framenum, it->second.weight));
+  for (int i = 0; i < infos.size(); i++) {
+    infos[i].history.push_back(make_pair(framenum, infos[i].weight));
   }
 }
 
@@ -61,23 +158,23 @@ Motifs *Motifs::LoadFromFile(const string &filename) {
     }
 
     // printf("MOTIF: %f | %s\n", d, InputsToString(inputs).c_str());
-    mm->motifs.insert(make_pair(inputs, Info(d)));
+    mm->infos[mm->AddMotif(inputs)].weight = d;
   }
 
+  mm->BuildTree();
   return mm;
 }
 
 void Motifs::SaveToFile(const string &filename) const {
   string out;
-  for (Weighted::const_iterator it = motifs.begin(); 
-       it != motifs.end(); ++it) {
-    const vector<uint8> &inputs = it->first;
-    string s = StringPrintf("%f ", it->second.weight);
-    s += InputsToString(inputs);
+  const vector<int> ids = SortedIds();
+  for (int i = 0; i < ids.size(); i++) {
+    string s = StringPrintf("%f ", infos[ids[i]].weight);
+    s += InputsToString(GetInputs(ids[i]));
     out += s + "\n";
   }
   // printf("%s\n", out.c_str());
-  printf("Wrote %lld motifs to %s.\n", motifs.size(), filename.c_str());
+  printf("Wrote %lld motifs to %s.\n", infos.size(), filename.c_str());
   Util::WriteFile(filename, out);
 }
 
@@ -89,86 +186,135 @@ void Motifs::AddInputs(const vector<uint8> &inputs) {
   for (int i = 0; i < inputs.size(); i++) {
     current.push_back(inputs[i]);
     if (current.size() == CHUNK_SIZE) {
-      motifs[current].weight += 1.0;
+      infos[AddMotif(current)].weight += 1.0;
       current.clear();
     }
   }
 
   if (!current.empty()) {
-    motifs[current].weight += 1.0;
+    infos[AddMotif(current)].weight += 1.0;
   }
+
+  BuildTree();
 }
 
 vector< vector<uint8> > Motifs::AllMotifs() const {
   vector< vector<uint8> > motifvec;
-  for (Weighted::const_iterator it = motifs.begin();
-       it != motifs.end(); ++it) {
-    motifvec.push_back(it->first);
+  const vector<int> ids = SortedIds();
+  for (int i = 0; i < ids.size(); i++) {
+    motifvec.push_back(GetInputs(ids[i]));
   }
   return motifvec;
 }
 
-const vector<uint8> &Motifs::RandomMotifWith(ArcFour *rrc) {
-  const vector<uint8> *res = NULL;
-  uint32 best = ~0;
-
-  CHECK(!motifs.empty());
-  for (Weighted::const_iterator it = motifs.begin();
-       it != motifs.end(); ++it) {
-    uint32 thisone = RandomInt32(rrc);
-    if (res == NULL || thisone < best) {
-      best = thisone;
-      res = &it->first;
-    }
-  }
+int Motifs::RandomMotifIdWith(ArcFour *rrc) {
+  CHECK(!infos.empty());
+  return RandomInt32(rrc) % infos.size();
+}
 
-  return *res;
+int Motifs::RandomMotifId() {
+  return RandomMotifIdWith(&rc);
 }
 
-const vector<uint8> &Motifs::RandomMotif() {
+vector<uint8> Motifs::RandomMotifWith(ArcFour *rrc) {
+  return GetInputs(RandomMotifIdWith(rrc));
+}
+
+vector<uint8> Motifs::RandomMotif() {
   return RandomMotifWith(&rc);
 }
 
-double *Motifs::GetWeightPtr(const vector<uint8> &inputs) {
-  Weighted::iterator it = motifs.find(inputs);
-  if (it == motifs.end()) return NULL;
-  else return &it->second.weight;
+void Motifs::SetWeight(int id, double weight) {
+  const int n = infos.size();
+  const double delta = weight - infos[id].weight;
+  infos[id].weight = weight;
+
+  // Roundoff in the sums is proportional to the number of updates,
+  // and rebuilding is linear, so this keeps both small.
+  if (++updates > n) {
+    BuildTree();
+    return;
+  }
+  for (int i = id + 1; i <= n; i += i & -i) tree[i] += delta;
 }
 
 double Motifs::GetTotalWeight() const {
-  double totalweight = 0.0;
-  for (Weighted::const_iterator it = motifs.begin();
-       it != motifs.end(); ++it) {
-    totalweight += it->second.weight;
-  }
-  return totalweight;
+  return PrefixWeight(infos.size());
 }
 
 // Note there are several fancy ways to do this, but I
 // have seen them have numerical stability problems in
-// practice. I'm favoring correctness and simplicity
-// here.
-const vector<uint8> &Motifs::RandomWeightedMotifWith(ArcFour *rrc) {
+// practice. The Fenwick tree is the same as scanning the
+// cumulative weights in order, except that the sums are
+// grouped differently.
+int Motifs::RandomWeightedMotifIdWith(ArcFour *rrc) {
   double totalweight = GetTotalWeight();
 
   // "index" into the continuous bins
   double sample = RandomDouble(rrc) * totalweight;
-  
-  for (Weighted::const_iterator it = motifs.begin();
-       it != motifs.end(); ++it) {
-    if (sample <= it->second.weight) {
-      return it->first;
-    }
-    sample -= it->second.weight;
+
+  const int idx = FindWeight(sample);
+  if (idx < infos.size()) {
+    return idx;
   }
-  
+
   // Arbitrarily award roundoff errors to the first one.
-  printf("roundoff error of %f in RandomWeightedMotif\n", sample);
-  CHECK(!motifs.empty());
-  return motifs.begin()->first;
+  printf("roundoff error of %f in RandomWeightedMotif\n",
+	 sample - totalweight);
+  CHECK(!infos.empty());
+  return 0;
+}
+
+vector<uint8> Motifs::RandomWeightedMotifWith(ArcFour *rrc) {
+  return GetInputs(RandomWeightedMotifIdWith(rrc));
+}
+
+int Motifs::RandomWeightedIdNotIn(vector<int> *excluded) {
+  const int n = infos.size();
+  std::sort(excluded->begin(), excluded->end());
+
+  double excludedweight = 0.0;
+  for (int i = 0; i < excluded->size(); i++) {
+    excludedweight += infos[(*excluded)[i]].weight;
+  }
+
+  // "index" into the continuous bins, skipping the excluded ones.
+  const double sample =
+    RandomDouble(&rc) * (GetTotalWeight() - excludedweight);
+  if (excluded->size() == n) return -1;
+
+  // Search the full bins, moving the sample past the weight of each
+  // excluded motif that comes before it. This always moves forward,
+  // so it's a search per excluded motif at most.
+  double target = sample;
+  int idx = FindWeight(target);
+  int next = 0;
+  while (next < excluded->size() && (*excluded)[next] <= idx) {
+    target += infos[(*excluded)[next]].weight;
+    next++;
+    idx = FindWeight(target);
+  }
+
+  if (idx < n && !std::binary_search(excluded->begin(),
+				     excluded->end(), idx)) {
+    return idx;
+  }
+
+  // Only possible with roundoff error, or when the remaining
+  // motifs have no weight; take the first one that's allowed.
+  for (int i = 0; i < n; i++) {
+    if (!std::binary_search(excluded->begin(), excluded->end(), i)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int Motifs::RandomWeightedMotifId() {
+  return RandomWeightedMotifIdWith(&rc);
 }
 
-const vector<uint8> &Motifs::RandomWeightedMotif() {
+vector<uint8> Motifs::RandomWeightedMotif() {
   return RandomWeightedMotifWith(&rc);
 }
 
@@ -202,9 +348,10 @@ bool Motifs::WeightDescending(const Resorted &a, const Resorted &b) {
 void Motifs::SaveHTML(const string &filename) const {
   string out = MOTIFS_STYLE;
   vector<Resorted> resorted;
-  for (Weighted::const_iterator it = motifs.begin();
-       it != motifs.end(); ++it) {
-    resorted.push_back(Resorted(it->second.weight, it->first, it->second));
+  const vector<int> ids = SortedIds();
+  for (int i = 0; i < ids.size(); i++) {
+    const Info &info = infos[ids[i]];
+    resorted.push_back(Resorted(info.weight, GetInputs(ids[i]), info));
   }
 
   std::sort(resorted.begin(), resorted.end(), WeightDescending);
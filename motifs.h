@@ -20,37 +20,63 @@ struct Motifs {
 
   void AddInputs(const vector<uint8> &inputs);
 
-  // Returns a motif uniformly at random.
-  // Linear time.
-  const vector<uint8> &RandomMotif();
-
-  // Returns one according to current weights.
-  // Linear time.
-  const vector<uint8> &RandomWeightedMotif();
-
-  const vector<uint8> &RandomMotifWith(ArcFour *rc);
-  const vector<uint8> &RandomWeightedMotifWith(ArcFour *rc);
-
-  // Returns NULL if none can be found.
+  // Motifs have ids from 0 to Size() - 1, in the order they were
+  // added (which is sorted order, when loaded from a file).
+  int Size() const { return infos.size(); }
+
+  // Returns the motif's id, or -1 if it isn't one. Constant time.
+  int GetId(const vector<uint8> &inputs) const;
+
+  // The motif's inputs, which are Length(id) bytes. They're stored
+  // together with the other motifs', so the pointer is invalidated
+  // by AddInputs.
+  const uint8 *Inputs(int id) const { return &arena[starts[id]]; }
+  int Length(int id) const { return starts[id + 1] - starts[id]; }
+  // A copy of them.
+  vector<uint8> GetInputs(int id) const;
+
+  // Returns the id of a motif uniformly at random.
+  // Constant time.
+  int RandomMotifId();
+
+  // Returns the id of one according to current weights.
+  // Logarithmic time.
+  int RandomWeightedMotifId();
+
+  int RandomMotifIdWith(ArcFour *rc);
+  int RandomWeightedMotifIdWith(ArcFour *rc);
+
+  // Same, but copying the inputs.
+  vector<uint8> RandomMotif();
+  vector<uint8> RandomWeightedMotif();
+  vector<uint8> RandomMotifWith(ArcFour *rc);
+  vector<uint8> RandomWeightedMotifWith(ArcFour *rc);
+
+  // Returns an id, or -1 if none can be found. The container holds
+  // motifs to exclude, as a set of them or the keys of a map. Takes
+  // time logarithmic in the number of motifs for each one excluded.
   template<class Container>
-  const vector<uint8> *RandomWeightedMotifNotIn(const Container &c);
+  int RandomWeightedMotifNotIn(const Container &c);
 
   // Return the total weight, which allows a single weight to
   // be interpreted as a fraction of the total (for example
   // for capping weights.)
   double GetTotalWeight() const;
 
+  // Copies of all of the motifs, in sorted order.
   vector< vector<uint8> > AllMotifs() const;
 
-  bool IsMotif(const vector<uint8> &inputs);
+  bool IsMotif(const vector<uint8> &inputs) const {
+    return GetId(inputs) >= 0;
+  }
 
   // Increment a counter (just used for diagnostics) that says
   // how many times this motif was picked.
-  void Pick(const vector<uint8> &inputs);
+  void Pick(int id);
 
-  // Returns a modifiable double for the input,
-  // or NULL if it has been added with AddInputs (etc.).
-  double *GetWeightPtr(const vector<uint8> &inputs);
+  // Get or set the weight of the motif. Setting is logarithmic time.
+  double GetWeight(int id) const { return infos[id].weight; }
+  void SetWeight(int id, double weight);
 
   // Save the current weights at the frame number (assumed
   // to be monotonically increasing), so that they can be
@@ -72,9 +98,52 @@ private:
   struct Resorted;
   static bool WeightDescending(const Resorted &a, const Resorted &b);
 
-  // XXX accessors or something?
-  typedef map<vector<uint8>, Info> Weighted;
-  Weighted motifs;
+  // The inputs of all of the motifs, one after another. Motif id's
+  // are arena[starts[id]] up to arena[starts[id + 1]].
+  vector<uint8> arena;
+  vector<int> starts;
+  vector<Info> infos;
+
+  // Hash table of motif ids, for finding them by their inputs. Its
+  // size is a power of two, at least twice the number of motifs,
+  // and empty slots are -1. Collisions go in the next free slot.
+  vector<int> table;
+  static uint64 HashInputs(const uint8 *inputs, int len);
+  // Returns the slot with the motif's id, or the empty one where it
+  // would go.
+  int FindSlot(const uint8 *inputs, int len) const;
+
+  // Orders ids by their inputs, like vectors of them.
+  struct IdLess;
+  vector<int> SortedIds() const;
+
+  // Fenwick tree over the weights in infos: tree[i] (1-based) is
+  // the sum of the weights of ids i - (i & -i) up to i - 1, so
+  // that prefix sums and updates take logarithmic time.
+  vector<double> tree;
+  // Updates since the tree was built from scratch. Floating point
+  // errors accumulate as weights change, so it's periodically rebuilt.
+  int updates;
+
+  // Adds an empty motif if it's new, and returns its id. The
+  // tree must be rebuilt afterwards.
+  int AddMotif(const vector<uint8> &inputs);
+  void BuildTree();
+  // Sum of the weights of ids 0 up to n - 1.
+  double PrefixWeight(int n) const;
+  // The first id at which the running sum of weights reaches
+  // sample; infos.size() if none.
+  int FindWeight(double sample) const;
+  // Like RandomWeightedMotifNotIn, for the ids of the excluded
+  // motifs, which are sorted in place.
+  int RandomWeightedIdNotIn(vector<int> *excluded);
+
+  template<class V>
+  static const vector<uint8> &Key(const pair<const vector<uint8>, V> &p) {
+    return p.first;
+  }
+  static const vector<uint8> &Key(const vector<uint8> &v) { return v; }
+
   ArcFour rc;
 
   NOT_COPYABLE(Motifs);
@@ -85,29 +154,17 @@ private:
 
 // See the related methods in the .cc file for commentary.
 template<class Container>
-const vector<uint8> *Motifs::RandomWeightedMotifNotIn(const Container &c) {
-  double totalweight = 0.0;
-  for (Weighted::const_iterator it = motifs.begin();
-       it != motifs.end(); ++it) {
-    if (c.find(it->first) == c.end()) {
-      totalweight += it->second.weight;
-    }
-  }
-
-  // "index" into the continuous bins
-  double sample = RandomDouble(&rc) * totalweight;
-
-  for (Weighted::const_iterator it = motifs.begin();
-       it != motifs.end(); ++it) {
-    if (c.find(it->first) == c.end()) {
-      if (sample <= it->second.weight) {
-        return &it->first;
-      }
-      sample -= it->second.weight;
+int Motifs::RandomWeightedMotifNotIn(const Container &c) {
+  vector<int> excluded;
+  for (typename Container::const_iterator it = c.begin();
+       it != c.end(); ++it) {
+    const int id = GetId(Key(*it));
+    if (id >= 0) {
+      excluded.push_back(id);
     }
   }
 
-  return NULL;
+  return RandomWeightedIdNotIn(&excluded);
 }
 
 
@@ -9,10 +9,48 @@
 #define VPRINTF if (VERBOSE_OBJECTIVE) printf
 
 Objective::Objective(const vector< vector<uint8> > &mm) :
-  memories(mm) {
+  memories(mm), num_words(0) {
   CHECK(!memories.empty());
   VPRINTF("Each memory is size %ld and there are %ld memories.\n",
 	  memories[0].size(), memories.size());
+
+  // The bitmaps are computed a location at a time, so this makes
+  // that a straight pass over memory.
+  columns.resize(memories[0].size());
+  for (int c = 0; c < columns.size(); c++) {
+    columns[c].resize(memories.size());
+  }
+  for (int i = 0; i < memories.size(); i++) {
+    const vector<uint8> &mem = memories[i];
+    for (int c = 0; c < columns.size(); c++) {
+      columns[c][i] = mem[c];
+    }
+  }
+}
+
+void Objective::SetLook(const vector<int> &look) {
+  // Enumeration is usually run many times on the same look.
+  if (num_words > 0 && look == cur_look)
+    return;
+
+  cur_look = look;
+  const int num_pairs = look.empty() ? 0 : look.size() - 1;
+  // Always at least one, so that the bitmaps aren't empty.
+  num_words = num_pairs / 64 + 1;
+  increased.clear();
+  increased.resize(columns.size() * num_words, 0ULL);
+  decreased.clear();
+  decreased.resize(columns.size() * num_words, 0ULL);
+  for (int c = 0; c < columns.size(); c++) {
+    const vector<uint8> &col = columns[c];
+    uint64 *inc = &increased[0] + c * num_words;
+    uint64 *dec = &decreased[0] + c * num_words;
+    for (int lo = 0; lo < num_pairs; lo++) {
+      const uint8 a = col[look[lo]], b = col[look[lo + 1]];
+      inc[lo >> 6] |= (uint64)(a < b) << (lo & 63);
+      dec[lo >> 6] |= (uint64)(a > b) << (lo & 63);
+    }
+  }
 }
 
 struct CompareByHash {
@@ -44,6 +82,8 @@ static void Shuffle(vector<int> *v, int seed) {
   std::sort(v->begin(), v->end(), c);
 }
 
+#if VERBOSE_OBJECTIVE
+// Only used for diagnostics in CheckOrdering.
 static bool EqualOnPrefix(const vector<uint8> &mem1, 
 			  const vector<uint8> &mem2,
 			  const vector<int> &prefix) {
@@ -57,6 +97,7 @@ static bool EqualOnPrefix(const vector<uint8> &mem1,
   }
   return true;
 }
+#endif
 
 static bool LessEqual(const vector<uint8> &mem1, 
 		      const vector<uint8> &mem2,
@@ -75,8 +116,7 @@ static bool LessEqual(const vector<uint8> &mem1,
   return true;
 }
 
-void Objective::EnumeratePartial(const vector<int> &look,
-				 vector<int> *prefix,
+void Objective::EnumeratePartial(const vector<uint64> &equal,
 				 const vector<int> &left,
 				 vector<int> *remain,
 				 vector<int> *candidates) {
@@ -88,56 +128,30 @@ void Objective::EnumeratePartial(const vector<int> &look,
   // in look where memory[i] == memory[j] for the prefix.
   // We only need to check consecutive memories; a distant
   // counterexample means that there is an adjacent
-  // counterexample somewhere in between.
-
-  // Cache this.
-  // indices lo in look where look[lo] and look[lo + 1]
-  // are equal on the prefix
-  vector<int> lequal;
-  lequal.reserve(look.size() - 1);
-  VPRINTF("Equal on prefix:");
-  for (int lo = 0; lo < look.size() - 1; lo++) {
-    int i = look[lo], j = look[lo + 1];
-    if (EqualOnPrefix(memories[i], memories[j], *prefix)) {
-      lequal.push_back(lo);
-      VPRINTF(" %d-%d", i, j);
-    }
-  }
-  VPRINTF("\n");
-
+  // counterexample somewhere in between. So this is just
+  // a matter of intersecting the bitmaps with equal.
+  //
+  // Locations already in the prefix never change where the
+  // prefix is equal, so they get filtered out like any other
+  // location that's always equal.
   for (int le = 0; le < left.size(); le++) {
     int c = left[le];
-    bool less = false;
-
-    // PERF I don't think this is actually necessary. Since this
-    // function returns ALL candidates, the candidates are also all in
-    // the remainder list. So, ignore anything that's already in the
-    // prefix. (But it should get ignored below since it will
-    // obviously be equal whenever EqualOnPrefix and it's in the
-    // prefix.)
-    for (int i = 0; i < prefix->size(); i++) {
-      if ((*prefix)[i] == c) {
-	VPRINTF("  skip %d in prefix\n", c);
-	goto skip;
-      }
-    }
-
-    for (int li = 0; li < lequal.size(); li++) {
-      int lo = lequal[li];
-      int i = look[lo], j = look[lo + 1];
-      VPRINTF("  at lo %d. i=%d, j=%d\n", lo, i, j);
-      if (memories[i][c] > memories[j][c]) {
-	// It may be legal later, but not a candidate.
-	remain->push_back(c);
-	VPRINTF("  skip %d because memories #%d and #%d have %d->%d\n",
-		c, i, j, memories[i][c], memories[j][c]);
-	goto skip;
+    const uint64 *inc = &increased[0] + c * num_words;
+    const uint64 *dec = &decreased[0] + c * num_words;
+    bool less = false, greater = false;
+    for (int w = 0; w < num_words; w++) {
+      if (dec[w] & equal[w]) {
+	greater = true;
+	break;
       }
-
-      less = less || memories[i][c] < memories[j][c];
+      if (inc[w] & equal[w]) less = true;
     }
 
-    if (less) {
+    if (greater) {
+      // It may be legal later, but not a candidate.
+      remain->push_back(c);
+      VPRINTF("  skip %d because it decreases\n", c);
+    } else if (less) {
       candidates->push_back(c);
       remain->push_back(c);
     } else {
@@ -145,8 +159,6 @@ void Objective::EnumeratePartial(const vector<int> &look,
       // interesting.
       VPRINTF("  %d is always equal; filtered.\n", c);
     }
-
-    skip:;
   }
 }
 
@@ -207,6 +219,7 @@ static void CheckOrdering(const vector<int> &look,
 
 void Objective::EnumeratePartialRec(const vector<int> &look,
 				    vector<int> *prefix,
+				    const vector<uint64> &equal,
 				    const vector<int> &left,
 				    void (*f)(const vector<int> &ordering),
 				    int *limit, int seed) {
@@ -233,7 +246,7 @@ void Objective::EnumeratePartialRec(const vector<int> &look,
 #endif
 
   vector<int> candidates, remain;
-  EnumeratePartial(look, prefix, left, &remain, &candidates);
+  EnumeratePartial(equal, left, &remain, &candidates);
 
   if (seed != 0) {
     seed += *limit + prefix->size();
@@ -262,9 +275,17 @@ void Objective::EnumeratePartialRec(const vector<int> &look,
     if (*limit > 0) --*limit;
   } else {
     prefix->resize(prefix->size() + 1);
+    vector<uint64> next_equal(num_words);
     for (int i = 0; i < candidates.size(); i++) {
-      (*prefix)[prefix->size() - 1] = candidates[i];
-      EnumeratePartialRec(look, prefix, remain, f, limit, seed);
+      const int c = candidates[i];
+      (*prefix)[prefix->size() - 1] = c;
+      // Still equal on the prefix when c doesn't change.
+      const uint64 *inc = &increased[0] + c * num_words;
+      const uint64 *dec = &decreased[0] + c * num_words;
+      for (int w = 0; w < num_words; w++) {
+	next_equal[w] = equal[w] & ~(inc[w] | dec[w]);
+      }
+      EnumeratePartialRec(look, prefix, next_equal, remain, f, limit, seed);
       if (*limit == 0) {
 	prefix->resize(prefix->size() - 1);
 	return;
@@ -281,7 +302,13 @@ void Objective::EnumerateFull(const vector<int> &look,
   for (int i = 0; i < memories[0].size(); i++) {
     left.push_back(i);
   }
-  EnumeratePartialRec(look, &prefix, left, f, &limit, seed);
+  SetLook(look);
+  // Every pair is equal on the empty prefix.
+  vector<uint64> equal(num_words, 0ULL);
+  for (int lo = 0; lo + 1 < look.size(); lo++) {
+    equal[lo >> 6] |= 1ULL << (lo & 63);
+  }
+  EnumeratePartialRec(look, &prefix, equal, left, f, &limit, seed);
 }
 
 void Objective::EnumerateFullAll(void (*f)(const vector<int> &ordering),
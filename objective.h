@@ -90,6 +90,9 @@ private:
 
   // Look gives the memory indices to look at.
   // Prefix is memory locations forming a lexicographic ordering.
+  // Equal is a bitmap with a bit for each pair of consecutive
+  // memories in look (bit lo for look[lo] and look[lo + 1]), set
+  // when they are equal on the prefix.
   // Left contains the indices of memory locations left to consider
   // for extending the prefix. These may not overlap the prefix.
   // (Invariant: mem[look[i]] <= mem[look[j]] according to the prefix, when
@@ -97,17 +100,33 @@ private:
   // All arguments are morally constant, but can be modified and replaced
   // during recursion.
   // XXX docs
-  void EnumeratePartial(const vector<int> &look,
-                        vector<int> *prefix,
+  void EnumeratePartial(const vector<uint64> &equal,
                         const vector<int> &left,
                         vector<int> *remain,
                         vector<int> *candidates);
 
   void EnumeratePartialRec(const vector<int> &look,
                            vector<int> *prefix,
+                           const vector<uint64> &equal,
                            const vector<int> &left,
                            void (*f)(const vector<int> &ordering),
                            int *limit, int seed);
 
+  // Computes the bitmaps below for the pairs of consecutive memories
+  // in look, unless they're already for that look.
+  void SetLook(const vector<int> &look);
+
   const vector< vector<uint8> > &memories;
+
+  // The memories transposed, so that columns[c][i] is memories[i][c].
+  vector< vector<uint8> > columns;
+
+  // The look that the bitmaps are for, and the number of 64-bit
+  // words in each.
+  vector<int> cur_look;
+  int num_words;
+  // For each memory location c, bitmaps starting at c * num_words
+  // with bit lo set when the location increases (or decreases) from
+  // look[lo] to look[lo + 1].
+  vector<uint64> increased, decreased;
 };
@@ -1062,29 +1062,28 @@ struct PlayFun {
     // This should be a motif in the normal case where we're trying
     // each motif, but when we use this to implement the best
     // backtrack plan, it usually won't be.
-    if (motifs->IsMotif(nexts[best_next_idx])) {
+    const int motif_id = motifs->GetId(nexts[best_next_idx]);
+    if (motif_id >= 0) {
       double total = motifs->GetTotalWeight();
-      motifs->Pick(nexts[best_next_idx]);
+      motifs->Pick(motif_id);
       vector<uint8> new_memory;
       Emulator::GetMemory(&new_memory);
       double oldval = objectives->GetNormalizedValue(current_memory);
       double newval = objectives->GetNormalizedValue(new_memory);
-      double *weight = motifs->GetWeightPtr(nexts[best_next_idx]);
-      // Already checked it's a motif.
-      CHECK(weight != NULL);
+      const double weight = motifs->GetWeight(motif_id);
       if (newval > oldval) {
 	// Increases its weight.
-	double d = *weight / MOTIF_ALPHA;
+	double d = weight / MOTIF_ALPHA;
 	if (d / total < MOTIF_MAX_FRAC) {
-	  *weight = d;
+	  motifs->SetWeight(motif_id, d);
 	} else {
 	  fprintf(stderr, "motif is already at max frac: %.2f\n", d);
 	}
       } else {
 	// Decreases its weight.
-	double d = *weight * MOTIF_ALPHA;
+	double d = weight * MOTIF_ALPHA;
 	if (d / total > MOTIF_MIN_FRAC) {
-	  *weight = d;
+	  motifs->SetWeight(motif_id, d);
 	} else {
 	  fprintf(stderr, "motif is already at min frac: %f\n", d);
 	}
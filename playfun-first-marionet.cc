@@ -698,21 +698,22 @@ struct PlayFun {
       // Now, if the motif we used was a local improvement to the
       // score, reweight it.
       {
-	motifs->Pick(nexts[best_next_idx]);
+	const int motif_id = motifs->GetId(nexts[best_next_idx]);
+	if (motif_id >= 0) motifs->Pick(motif_id);
 	vector<uint8> new_memory;
 	Emulator::GetMemory(&new_memory);
 	double oldval = objectives->GetNormalizedValue(current_memory);
 	double newval = objectives->GetNormalizedValue(new_memory);
-	double *weight = motifs->GetWeightPtr(nexts[best_next_idx]);
-	if (weight == NULL) {
+	if (motif_id < 0) {
 	  printf(" * ERROR * Used a motif that doesn't exist?\n");
 	} else {
+	  const double weight = motifs->GetWeight(motif_id);
 	  if (newval > oldval) {
 	    // Increases its weight.
-	    *weight /= ALPHA;
+	    motifs->SetWeight(motif_id, weight / ALPHA);
 	  } else {
 	    // Decreases its weight.
-	    *weight *= ALPHA;
+	    motifs->SetWeight(motif_id, weight * ALPHA);
 	  }
 	}
       }
@@ -24,10 +24,24 @@
 
     double best_score = -1;
     uint8 best_input = 0;
+    // (mask, input & mask) for the inputs we've tried. Inputs that
+    // agree with one on its mask get the same score; skip them.
+    vector< pair<uint8, uint8> > tried;
     for (int i = 0; i < inputs.size(); i++) {
+      bool equivalent = false;
+      for (int t = 0; t < tried.size(); t++) {
+	if ((inputs[i] & tried[t].first) == tried[t].second) {
+	  equivalent = true;
+	  break;
+	}
+      }
+      if (equivalent) continue;
+
       // (Don't restore for first one; it's already there)
       if (i != 0) Emulator::Load(&current_state);
       Emulator::Step(inputs[i]);
+      const uint8 mask = Emulator::InputMask();
+      tried.push_back(make_pair(mask, (uint8)(inputs[i] & mask)));
 
       vector<uint8> new_memory;
       GetMemory(&new_memory);
@@ -33,10 +33,13 @@
 #include "simplefm2.h"
 #include "weighted-objectives.h"
 #include "motifs.h"
+#include "markov.h"
 #include "../cc-lib/arcfour.h"
 #include "util.h"
 #include "../cc-lib/textsvg.h"
 #include "game.h"
+#include "worker-pool.h"
+#include "prefix-cache.h"
 
 #if MARIONET
 #include "SDL.h"
@@ -122,16 +125,23 @@ namespace {
 struct Future {
   vector<uint8> inputs;
   bool weighted;
+  // If not weighted, whether the inputs come from the Markov
+  // model rather than random motifs.
+  bool markov;
   int desired_length;
   // TODO
   int rounds_survived;
   bool is_mutant;
-  Future() : weighted(true), desired_length(0), rounds_survived(0),
-	     is_mutant(false) {}
-  Future(bool w, int d) : weighted(w),
-			  desired_length(d),
-			  rounds_survived(0),
-			  is_mutant(false) {}
+  Future() : weighted(true), markov(false), desired_length(0),
+	     rounds_survived(0), is_mutant(false) {}
+  Future(bool w, int d, bool m = false) : weighted(w),
+					  markov(m),
+					  desired_length(d),
+					  rounds_survived(0),
+					  is_mutant(false) {}
+  const char *Kind() const {
+    return weighted ? "weighted" : markov ? "markov" : "random";
+  }
 };
 
 // For backtracking.
@@ -150,7 +160,7 @@ static void SaveFuturesHTML(const vector<Future> &futures,
 			futures[i].inputs.size(),
 			futures[i].desired_length,
 			futures[i].is_mutant ? "mutant" : "fresh",
-			futures[i].weighted ? "weighted" : "random");
+			futures[i].Kind());
     for (int j = 0; j < futures[i].inputs.size(); j++) {
       out += SimpleFM2::InputToColorString(futures[i].inputs[j]);
     }
@@ -160,8 +170,9 @@ static void SaveFuturesHTML(const vector<Future> &futures,
   printf("Wrote futures to %s\n", filename.c_str());
 }
 
-struct PlayFun {
-  PlayFun() : watermark(0), log(NULL), rc("playfun") {
+struct PlayFun : public WorkerPool::Worker {
+  PlayFun() : watermark(0), workers(NULL), log(NULL), rc("playfun"),
+	      markov(NULL) {
     Emulator::Initialize(GAME ".nes");
     objectives = WeightedObjectives::LoadFromFile(GAME ".objectives");
     CHECK(objectives);
@@ -170,7 +181,21 @@ struct PlayFun {
     motifs = Motifs::LoadFromFile(GAME ".motifs");
     CHECK(motifs);
 
-    Emulator::ResetCache(100000, 10000);
+    if (NMARKOVFUTURES > 0) {
+      markov = Markov::LoadFromFile(GAME ".markov");
+      CHECK(markov);
+    }
+
+    // Each entry holds at most one (shared) state, so this is the
+    // same memory as the old 100000 entries of two states each.
+    Emulator::ResetCache(200000, 10000);
+
+    // Edges are the same length as nexts (see MakeNexts), so that
+    // futures that start with a next share its prefix. Each edge
+    // keeps an uncompressed state. Every process that plays futures
+    // (this one, or each MARIONET helper) fills its own cache; with
+    // local workers, StartWorkers splits this between them.
+    prefix_cache = new PrefixCache(10, PREFIX_CACHE_EDGES);
 
     motifvec = motifs->AllMotifs();
 
@@ -192,6 +217,10 @@ struct PlayFun {
 	  "one observation to score.");
 
     printf("Skipped %ld frames until first keypress/ffwd.\n", start);
+
+    // Now that we're in the game, the current state is a good
+    // basis for diffing cached states against.
+    Emulator::SetCacheCodec(Emulator::CACHE_DIFF, NULL);
   }
 
   // PERF. Shouldn't really save every memory, but
@@ -227,6 +256,9 @@ struct PlayFun {
   // Number of futures that should be generated from weighted
   // motifs as opposed to totally random.
   static const int NWEIGHTEDFUTURES = 35;
+  // Number of the rest that should be generated from the Markov
+  // model of inputs (see markov.h) instead of random motifs.
+  static const int NMARKOVFUTURES = 0;
 
   // Drop this many of the worst futures and replace them with
   // totally new futures.
@@ -239,6 +271,16 @@ struct PlayFun {
   static const int MINFUTURELENGTH = 50;
   static const int MAXFUTURELENGTH = 800;
 
+  // If true, ParallelStep tells each next the best score so far,
+  // and InnerLoop stops playing its futures once it can prove that
+  // the next can't beat it. The chosen next is the same, but those
+  // nexts don't count towards the scores of the futures.
+  static const bool ABANDON_HOPELESS = false;
+
+  // Total number of edges (each with a full state) in the prefix
+  // caches of the processes on this machine that play futures.
+  static const int PREFIX_CACHE_EDGES = 20000;
+
   static const bool TRY_BACKTRACK = true;
   // Make a checkpoint this often (number of inputs).
   static const int CHECKPOINT_EVERY = 100;
@@ -288,22 +330,6 @@ struct PlayFun {
     }
   }
 
-  // DESTROYS THE STATE
-  void ScoreByFuture(const Future &future,
-		     const vector<uint8> &base_memory,
-		     vector<uint8> *base_state,
-		     double *positive_scores,
-		     double *negative_scores,
-		     double *integral_score) {
-    vector<uint8> future_memory;
-    double integral = ScoreIntegral(base_state, future.inputs, &future_memory);
-
-    *integral_score = integral / future.inputs.size();
-    *positive_scores = objectives->WeightedLess(base_memory, future_memory);
-    // Note negation; WeightedLess always returns non-negative score.
-    *negative_scores = -objectives->WeightedLess(future_memory, base_memory);
-  }
-
   #if MARIONET
   static void ReadBytesFromProto(const string &pf, vector<uint8> *bytes) {
     // PERF iterators.
@@ -364,12 +390,13 @@ struct PlayFun {
 	  double immediate_score, best_future_score, worst_future_score,
 	    futures_score;
 	  vector<double> futurescores(futures.size(), 0.0);
+	  int skipped;
 
-	  // Do the work.
-	  InnerLoop(next, futures, &current_state,
+	  // Do the work. Helpers always play every future.
+	  InnerLoop(next, futures, &current_state, -1e80,
 		    &immediate_score, &best_future_score,
 		    &worst_future_score, &futures_score,
-		    &futurescores);
+		    &futurescores, &skipped);
 
 	  PlayFunResponse res;
 	  res.set_immediate_score(immediate_score);
@@ -416,6 +443,7 @@ struct PlayFun {
       server.Hangup();
     }
   }
+  #endif
 
   template<class F, class S>
   struct CompareByFirstDesc {
@@ -425,77 +453,128 @@ struct PlayFun {
     }
   };
 
+  // Ways of finding replacements for a span of inputs in TryImprove.
+  // These have the same values as TryImproveRequest::Approach in
+  // marionet.proto, which documents them.
+  enum ImproveApproach {
+    IMPROVE_RANDOM = 0,
+    IMPROVE_OPPOSITES = 1,
+    IMPROVE_ABLATION = 2,
+    IMPROVE_CHOP = 3,
+  };
+
+  static string ApproachName(int approach) {
+    switch (approach) {
+    case IMPROVE_RANDOM: return "RANDOM";
+    case IMPROVE_OPPOSITES: return "OPPOSITES";
+    case IMPROVE_ABLATION: return "ABLATION";
+    case IMPROVE_CHOP: return "CHOP";
+    default: return "UNKNOWN";
+    }
+  }
+
+  #if MARIONET
   void DoTryImprove(const TryImproveRequest &req,
 		    TryImproveResponse *res) {
     vector<uint8> start_state, end_state;
     ReadBytesFromProto(req.start_state(), &start_state);
     ReadBytesFromProto(req.end_state(), &end_state);
-    const double end_integral = req.end_integral();
 
     vector<uint8> improveme;
     ReadBytesFromProto(req.improveme(), &improveme);
 
+    InPlaceTerminal term(1);
+    vector< pair< double, vector<uint8> > > repls;
+    const int nimproved = DoTryImprove(&term, req.approach(), req.seed(),
+				       req.iters(), req.maxbest(),
+				       &start_state, &end_state,
+				       req.end_integral(), improveme,
+				       &repls);
+
+    for (int i = 0; i < repls.size(); i++) {
+      res->add_inputs(&repls[i].second[0], repls[i].second.size());
+      res->add_score(repls[i].first);
+    }
+
+    // XXX I think that some can produce more than iters outputs,
+    // so better could be greater than 100%.
+    res->set_iters_tried(req.iters());
+    res->set_iters_better(nimproved);
+  }
+  #endif
+
+  // Tries iters variations on improveme, which gets from start_state
+  // to end_state with score end_integral, using the given approach
+  // and seed. Puts the best maxbest improvements in repls and returns
+  // the total number of improvements found. The terminal can be NULL
+  // to skip the progress output.
+  int DoTryImprove(InPlaceTerminal *term, int approach,
+		   const string &seed, int iters, int maxbest,
+		   vector<uint8> *start_state,
+		   vector<uint8> *end_state,
+		   double end_integral,
+		   const vector<uint8> &improveme,
+		   vector< pair< double, vector<uint8> > > *repls_out) {
     // Get the memories so that we can score.
     vector<uint8> start_memory, end_memory;
-    Emulator::LoadUncompressed(&end_state);
+    Emulator::LoadUncompressed(end_state);
     Emulator::GetMemory(&end_memory);
 
-    Emulator::LoadUncompressed(&start_state);
+    Emulator::LoadUncompressed(start_state);
     Emulator::GetMemory(&start_memory);
 
-    InPlaceTerminal term(1);
-
-    vector< pair< double, vector<uint8> > > repls;
+    vector< pair< double, vector<uint8> > > &repls = *repls_out;
+    repls.clear();
 
-    ArcFour rc(req.seed());
-    if (req.approach() == TryImproveRequest::RANDOM) {
-      for (int i = 0; i < req.iters(); i++) {
+    ArcFour rc(seed);
+    if (approach == IMPROVE_RANDOM) {
+      for (int i = 0; i < iters; i++) {
 	// Get a random sequence of inputs.
 	vector<uint8> inputs = GetRandomInputs(&rc, improveme.size());
 
 	// Now execute it.
 	double score = 0.0;
-	if (IsImprovement(&term, (double)i / req.iters(),
-			  &start_state,
+	if (IsImprovement(term, (double)i / iters,
+			  start_state,
 			  start_memory,
 			  inputs,
 			  end_memory, end_integral, &score)) {
-	  term.Advance();
+	  if (term != NULL) term->Advance();
 	  fprintf(stderr, "Improved! %f\n", score);
 	  repls.push_back(make_pair(score, inputs));
 	}
       }
-    } else if (req.approach() == TryImproveRequest::OPPOSITES) {
+    } else if (approach == IMPROVE_OPPOSITES) {
       vector<uint8> inputs = improveme;
 
-      TryDualizeAndReverse(&term, 0,
-			   &start_state, start_memory,
+      TryDualizeAndReverse(term, 0,
+			   start_state, start_memory,
 			   &inputs, 0, inputs.size(),
 			   end_memory, end_integral, &repls,
 			   false);
 
-      TryDualizeAndReverse(&term, 0,
-			   &start_state, start_memory,
+      TryDualizeAndReverse(term, 0,
+			   start_state, start_memory,
 			   &inputs, 0, inputs.size() / 2,
 			   end_memory, end_integral, &repls,
 			   false);
 
-      for (int i = 0; i < req.iters(); i++) {
+      for (int i = 0; i < iters; i++) {
 	int start, len;
 	GetRandomSpan(inputs, 1.0, &rc, &start, &len);
 	if (len == 0 && start != inputs.size()) len = 1;
 	bool keepreversed = rc.Byte() & 1;
 
 	// XXX Note, does nothing when len = 0.
-	TryDualizeAndReverse(&term, (double)i / req.iters(),
-			     &start_state, start_memory,
+	TryDualizeAndReverse(term, (double)i / iters,
+			     start_state, start_memory,
 			     &inputs, start, len,
 			     end_memory, end_integral, &repls,
 			     keepreversed);
       }
 
-    } else if (req.approach() == TryImproveRequest::ABLATION) {
-      for (int i = 0; i < req.iters(); i++) {
+    } else if (approach == IMPROVE_ABLATION) {
+      for (int i = 0; i < iters; i++) {
 	vector<uint8> inputs = improveme;
 	uint8 mask;
 	// No sense in getting a mask that keeps everything.
@@ -511,26 +590,26 @@ struct PlayFun {
 	// never in the input.
 	double score = 0.0;
 	if (inputs != improveme &&
-	    IsImprovement(&term, (double)i / req.iters(),
-			  &start_state,
+	    IsImprovement(term, (double)i / iters,
+			  start_state,
 			  start_memory,
 			  inputs,
 			  end_memory, end_integral, &score)) {
-	  term.Advance();
+	  if (term != NULL) term->Advance();
 	  fprintf(stderr, "Improved (abl %d)! %f\n", mask, score);
 	  repls.push_back(make_pair(score, inputs));
 	}
       }
-    } else if (req.approach() == TryImproveRequest::CHOP) {
+    } else if (approach == IMPROVE_CHOP) {
       set< vector<uint8> > tried;
 
-      for (int i = 0; i < req.iters(); i++) {
+      for (int i = 0; i < iters; i++) {
 	vector<uint8> inputs = improveme;
 
 	// We allow using iterations to chop more from the thing
 	// we just chopped, if it was an improvement.
 	int depth = 0;
-	for (; i < req.iters(); i++, depth++) {
+	for (; i < iters; i++, depth++) {
 	  int start, len;
 	  // Use exponent of 2 (prefer smaller spans) because
 	  // otherwise chopping is quite blunt.
@@ -540,12 +619,12 @@ struct PlayFun {
 	  ChopOut(&inputs, start, len);
 	  double score = 0.0;
 	  if (inputs != improveme &&
-	      IsImprovement(&term, (double) i / req.iters(),
-			    &start_state, start_memory,
+	      IsImprovement(term, (double) i / iters,
+			    start_state, start_memory,
 			    inputs,
 			    end_memory, end_integral,
 			    &score)) {
-	    term.Advance();
+	    if (term != NULL) term->Advance();
 	    fprintf(stderr, "Improved (chop %d for %d depth %d)! %f\n",
 		    start, len, depth, score);
 	    repls.push_back(make_pair(score, inputs));
@@ -562,33 +641,25 @@ struct PlayFun {
 	    // Don't keep chopping.
 	    break;
 	  }
-        }
+	}
       }
     }
 
     const int nimproved = repls.size();
 
-    if (repls.size() > req.maxbest()) {
+    if (repls.size() > maxbest) {
       std::sort(repls.begin(), repls.end(),
 		CompareByFirstDesc< double, vector<uint8> >());
-      repls.resize(req.maxbest());
-    }
-
-    for (int i = 0; i < repls.size(); i++) {
-      res->add_inputs(&repls[i].second[0], repls[i].second.size());
-      res->add_score(repls[i].first);
+      repls.resize(maxbest);
     }
 
-    // XXX I think that some can produce more than iters outputs,
-    // so better could be greater than 100%.
-    res->set_iters_tried(req.iters());
-    res->set_iters_better(nimproved);
-
-    term.Advance();
+    if (term != NULL) term->Advance();
     fprintf(stderr, "In %d iters (%s), %d were improvements (%.1f%%)\n",
-	    req.iters(),
-	    TryImproveRequest::Approach_Name(req.approach()).c_str(),
-	    nimproved, (100.0 * nimproved) / req.iters());
+	    iters,
+	    ApproachName(approach).c_str(),
+	    nimproved, (100.0 * nimproved) / iters);
+
+    return nimproved;
   }
 
   // Exponent controls the length of the span. Large exponents
@@ -626,7 +697,7 @@ struct PlayFun {
 		      *inputs,
 		      end_memory, end_integral,
 		      &score)) {
-      term->Advance();
+      if (term != NULL) term->Advance();
       fprintf(stderr, "Improved! %f\n", score);
       repls->push_back(make_pair(score, *inputs));
     }
@@ -639,7 +710,7 @@ struct PlayFun {
 		      *inputs,
 		      end_memory, end_integral,
 		      &score)) {
-      term->Advance();
+      if (term != NULL) term->Advance();
       fprintf(stderr, "Improved (rev)! %f\n", score);
       repls->push_back(make_pair(score, *inputs));
     }
@@ -694,16 +765,49 @@ struct PlayFun {
   double ScoreIntegral(vector<uint8> *start_state,
 		       const vector<uint8> &inputs,
 		       vector<uint8> *final_memory) {
-    Emulator::LoadUncompressed(start_state);
+    // Skip over however much of the input is already in the
+    // prefix cache, including the scores for those steps.
+    PrefixCache::Node node = PrefixCache::NodeFor(*start_state);
+    vector<double> values;
+    vector<uint8> prefix_state;
+    const int done =
+      prefix_cache->Follow(&node, inputs, &values, &prefix_state);
+
+    Emulator::LoadUncompressed(done > 0 ? &prefix_state : start_state);
     vector<uint8> previous_memory;
     Emulator::GetMemory(&previous_memory);
     double sum = 0.0;
-    for (int i = 0; i < inputs.size(); i++) {
-      Emulator::CachingStep(inputs[i]);
-      vector<uint8> new_memory;
-      Emulator::GetMemory(&new_memory);
-      sum += objectives->Evaluate(previous_memory, new_memory);
-      previous_memory.swap(new_memory);
+    // Same order of additions as without the cache, so that the
+    // result is exactly the same.
+    for (int i = 0; i < done; i++) {
+      sum += values[i];
+    }
+
+    // Play the rest a chunk at a time, adding whole chunks to the
+    // cache as we go.
+    const int stride = prefix_cache->Stride();
+    step_memories.resize(stride * 0x800);
+    for (int i = done; i < inputs.size(); i += stride) {
+      const int len = min(stride, (int)inputs.size() - i);
+      Emulator::CachingStepMany(&inputs[i], len, &step_memories[0]);
+
+      values.clear();
+      const uint8 *prev = &previous_memory[0];
+      for (int j = 0; j < len; j++) {
+	const uint8 *mem = &step_memories[j * 0x800];
+	const double value = objectives->Evaluate(prev, mem);
+	sum += value;
+	values.push_back(value);
+	prev = mem;
+      }
+      memcpy(&previous_memory[0], prev, 0x800);
+
+      if (len == stride) {
+	// PERF CachingStep already saved this state.
+	vector<uint8> state;
+	Emulator::SaveUncompressed(&state);
+	node = prefix_cache->Add(node, &inputs[i], state, &values[0]);
+      }
     }
     if (final_memory != NULL) {
       final_memory->swap(previous_memory);
@@ -821,10 +925,10 @@ struct PlayFun {
   vector<uint8> GetRandomInputs(ArcFour *rc, int len) {
     vector<uint8> inputs;
     while(inputs.size() < len) {
-      const vector<uint8> &m =
-	motifs->RandomWeightedMotifWith(rc);
+      const int id = motifs->RandomWeightedMotifIdWith(rc);
+      const uint8 *m = motifs->Inputs(id);
 
-      for (int x = 0; x < m.size(); x++) {
+      for (int x = 0; x < motifs->Length(id); x++) {
 	inputs.push_back(m[x]);
 	if (inputs.size() == len) {
 	  break;
@@ -833,17 +937,212 @@ struct PlayFun {
     }
     return inputs;
   }
-  #endif
 
 
+  // Where a walk along a future has gotten to in ScoreFutures,
+  // after depth of its inputs.
+  struct FuturePoint {
+    int depth;
+    // Only up to date when the point is kept for later futures.
+    vector<uint8> state;
+    vector<uint8> memory;
+    // Sum of the values so far, added in order.
+    double sum;
+    // The score of each step so far.
+    vector<double> values;
+    // The prefix cache node at the start and after each whole chunk.
+    vector<PrefixCache::Node> nodes;
+    FuturePoint() : depth(0), sum(0.0) {}
+  };
+
+  // Orders future indices by their inputs, so that futures with a
+  // common prefix are next to each other.
+  struct CompareFutureInputs {
+    explicit CompareFutureInputs(const vector<Future> &futures)
+      : futures(futures) {}
+    bool operator ()(int a, int b) const {
+      return futures[a].inputs < futures[b].inputs;
+    }
+    const vector<Future> &futures;
+  };
+
+  // Plays the future's inputs from the point until target, the same
+  // way as ScoreIntegral: whole chunks come from the prefix cache if
+  // possible, and new ones are added to it. The emulator must be in
+  // the point's state. Gives up and returns false if the sum for the
+  // whole future can no longer reach give_up_below.
+  bool AdvanceFuture(const vector<uint8> &inputs, int target,
+		     double give_up_below, FuturePoint *p) {
+    const int stride = prefix_cache->Stride();
+    const double max_step = objectives->TotalWeight();
+    step_memories.resize(stride * 0x800);
+    while (p->depth < target) {
+      if (p->sum + (inputs.size() - p->depth) * max_step < give_up_below) {
+	return false;
+      }
+
+      if (p->depth % stride == 0 && p->depth + stride <= target) {
+	const vector<uint8> rest(inputs.begin() + p->depth,
+				 inputs.begin() + target);
+	PrefixCache::Node node = p->nodes.back();
+	const int old = p->values.size();
+	const int done = prefix_cache->Follow(&node, rest, &p->values,
+					      &p->state, &p->nodes);
+	if (done > 0) {
+	  for (int j = old; j < p->values.size(); j++) {
+	    p->sum += p->values[j];
+	  }
+	  p->depth += done;
+	  Emulator::LoadUncompressed(&p->state);
+	  Emulator::GetMemory(&p->memory);
+	  continue;
+	}
+      }
+
+      // Play up to the end of this chunk or the target, if sooner.
+      const int chunk_start = p->depth - p->depth % stride;
+      const int len = min(chunk_start + stride, target) - p->depth;
+      Emulator::CachingStepMany(&inputs[p->depth], len, &step_memories[0]);
+
+      const uint8 *prev = &p->memory[0];
+      for (int j = 0; j < len; j++) {
+	const uint8 *mem = &step_memories[j * 0x800];
+	const double value = objectives->Evaluate(prev, mem);
+	p->sum += value;
+	p->values.push_back(value);
+	prev = mem;
+      }
+      memcpy(&p->memory[0], prev, 0x800);
+      p->depth += len;
+
+      if (p->depth == chunk_start + stride) {
+	Emulator::SaveUncompressed(&p->state);
+	p->nodes.push_back(prefix_cache->Add(p->nodes.back(),
+					     &inputs[chunk_start], p->state,
+					     &p->values[chunk_start]));
+      }
+    }
+    return true;
+  }
+
+  // Same as ScoreIntegral from the start state for each future,
+  // setting its integral score (normalized by length) and its final
+  // memory in future_memories. Futures are played in sorted order,
+  // so a prefix shared by several of them (like mutants and their
+  // parent) is only played once, keeping the state at each depth
+  // where they diverge.
+  //
+  // If the sum of the positive integral scores can be shown to end
+  // up below give_up_below, stops and returns false, setting bound
+  // to an upper bound on that sum and skipped to the number of
+  // inputs that were left to play. The integral scores are then
+  // incomplete.
+  bool ScoreFutures(vector<uint8> *start_state,
+		    const vector<Future> &futures,
+		    double give_up_below,
+		    vector<double> *integral_scores,
+		    double *bound, int *skipped) {
+    const int num_futures = futures.size();
+    // Bounds the integral score of a future that's not done yet.
+    const double max_step = objectives->TotalWeight();
+    integral_scores->resize(num_futures);
+    future_memories.resize(num_futures * 0x800);
+
+    vector<int> order;
+    for (int f = 0; f < num_futures; f++) order.push_back(f);
+    std::sort(order.begin(), order.end(), CompareFutureInputs(futures));
+
+    // shared[i] is the length of the common prefix of the ith and
+    // (i + 1)th futures in that order.
+    vector<int> shared(num_futures, 0);
+    for (int i = 0; i + 1 < num_futures; i++) {
+      const vector<uint8> &a = futures[order[i]].inputs;
+      const vector<uint8> &b = futures[order[i + 1]].inputs;
+      int n = 0;
+      while (n < a.size() && n < b.size() && a[n] == b[n]) n++;
+      shared[i] = n;
+    }
+
+    // Points that futures still to be played start from, with
+    // increasing depth.
+    vector<FuturePoint> points(1);
+    points[0].state = *start_state;
+    Emulator::LoadUncompressed(start_state);
+    Emulator::GetMemory(&points[0].memory);
+    points[0].nodes.push_back(PrefixCache::NodeFor(*start_state));
+
+    // Sum of the positive integral scores of the futures done so far.
+    double done_sum = 0.0;
+    *skipped = 0;
+    for (int i = 0; i < num_futures; i++) {
+      const vector<uint8> &inputs = futures[order[i]].inputs;
+      const int start = i > 0 ? shared[i - 1] : 0;
+      while (points.back().depth > start) points.pop_back();
+      CHECK(points.back().depth == start);
+      FuturePoint cur = points.back();
+      if (i > 0) Emulator::LoadUncompressed(&cur.state);
+
+      // Depths past the start where later futures leave this one.
+      // The prefix shared with each later future only shrinks, so
+      // these come out deepest first.
+      vector<int> branches;
+      int common = inputs.size();
+      for (int k = i; k + 1 < num_futures; k++) {
+	common = min(common, shared[k]);
+	if (common <= start) break;
+	if (branches.empty() || branches.back() != common) {
+	  branches.push_back(common);
+	}
+      }
+
+      // What this future's integral has to reach for the total to
+      // reach give_up_below, even if the rest get the most possible.
+      const double room = give_up_below - done_sum -
+	(num_futures - 1 - i) * max_step;
+      const double give_up = room > 0 ? room * inputs.size() : -1e80;
+
+      while (!branches.empty() &&
+	     AdvanceFuture(inputs, branches.back(), give_up, &cur)) {
+	branches.pop_back();
+	Emulator::SaveUncompressed(&cur.state);
+	points.push_back(cur);
+      }
+      if (!branches.empty() ||
+	  !AdvanceFuture(inputs, inputs.size(), give_up, &cur)) {
+	const double most =
+	  (cur.sum + (inputs.size() - cur.depth) * max_step) / inputs.size();
+	*bound = done_sum + max(most, 0.0) + (num_futures - 1 - i) * max_step;
+	*skipped = inputs.size() - cur.depth;
+	for (int k = i + 1; k < num_futures; k++) {
+	  *skipped += futures[order[k]].inputs.size() - shared[k - 1];
+	}
+	return false;
+      }
+
+      const double integral = cur.sum / inputs.size();
+      (*integral_scores)[order[i]] = integral;
+      if (integral > 0) done_sum += integral;
+      memcpy(&future_memories[order[i] * 0x800], &cur.memory[0], 0x800);
+    }
+    return true;
+  }
+
+  // Scores the next followed by each of the futures. If the next's
+  // score (immediate_score + futures_score) can be shown to be less
+  // than abandon_below, stops early: then futures_score is only an
+  // upper bound (still less than abandon_below), futurescores are
+  // left alone, and skipped is the number of future inputs that
+  // weren't played. Otherwise skipped is 0.
   void InnerLoop(const vector<uint8> &next,
 		 const vector<Future> &futures_orig,
 		 vector<uint8> *current_state,
+		 double abandon_below,
 		 double *immediate_score,
 		 double *best_future_score,
 		 double *worst_future_score,
 		 double *futures_score,
-		 vector<double> *futurescores) {
+		 vector<double> *futurescores,
+		 int *skipped) {
 
     // Make copy so we can make fake futures.
     vector<Future> futures = futures_orig;
@@ -895,13 +1194,36 @@ struct PlayFun {
       futures.push_back(fakefuture_hold);
     }
 
+    // Play the futures, keeping their final memories. (This destroys
+    // the state.)
+    const int num_futures = futures.size();
+    // Each future's positive score is at most this, so this is what
+    // the integral scores have to make up.
+    const double max_positive = objectives->TotalWeight();
+    vector<double> integral_scores;
+    double integral_bound;
+    if (!ScoreFutures(&new_state, futures,
+		      abandon_below - *immediate_score -
+		      num_futures * max_positive,
+		      &integral_scores, &integral_bound, skipped)) {
+      *futures_score = num_futures * max_positive + integral_bound;
+      *best_future_score = *worst_future_score = 0.0;
+      return;
+    }
+
+    // Then compare them all to the new memory at once.
+    vector<double> all_positive_scores(num_futures),
+      all_negative_scores(num_futures);
+    objectives->EvaluateMany(&new_memory[0], &future_memories[0],
+			     num_futures,
+			     &all_positive_scores[0], &all_negative_scores[0],
+			     NULL);
+
     *futures_score = 0.0;
-    for (int f = 0; f < futures.size(); f++) {
-      if (f != 0) Emulator::LoadUncompressed(&new_state);
-      double positive_scores, negative_scores, integral_score;
-      ScoreByFuture(futures[f], new_memory, &new_state,
-		    &positive_scores, &negative_scores,
-		    &integral_score);
+    for (int f = 0; f < num_futures; f++) {
+      const double positive_scores = all_positive_scores[f];
+      const double negative_scores = all_negative_scores[f];
+      const double integral_score = integral_scores[f];
       CHECK(positive_scores >= 0);
       CHECK(negative_scores <= 0);
 
@@ -945,7 +1267,31 @@ struct PlayFun {
     // futures.resize(futures.size() - NUM_FAKE_FUTURES);
   }
 
-  // The parallel step. We either run it in serial locally
+  // Adds the score that each next has to beat to the local requests
+  // of ParallelStep, as they are sent to the workers (see InnerLoop).
+  // That's the best score of the nexts that are done so far, since
+  // ParallelStep only takes a next whose score is higher (and above
+  // 0). The next that it takes is therefore the same as if all of
+  // them were scored in full.
+  struct NextBounds : public WorkerPool::Progress {
+    NextBounds() : best(0.0) {}
+    void Sending(int idx, string *request) {
+      WorkerPool::Writer w(request);
+      w.Double(ABANDON_HOPELESS ? best : -1e80);
+    }
+    void Received(int idx, const string &response) {
+      WorkerPool::Reader r(response);
+      const double immediate_score = r.Double();
+      // Best and worst future scores.
+      (void)r.Double();
+      (void)r.Double();
+      const double score = immediate_score + r.Double();
+      if (score > best) best = score;
+    }
+    double best;
+  };
+
+  // The parallel step. We either run it on local forked workers
   // (without MARIONET) or as jobs on helpers, via TCP.
   void ParallelStep(const vector< vector<uint8> > &nexts,
 		    const vector<Future> &futures,
@@ -988,7 +1334,7 @@ struct PlayFun {
     for (int i = 0; i < work.size(); i++) {
       const PlayFunResponse &res = work[i].res;
       for (int f = 0; f < res.futurescores_size(); f++) {
-	CHECK(f <= futuretotals->size());
+	CHECK(f < futuretotals->size());
 	(*futuretotals)[f] += res.futurescores(f);
       }
 
@@ -1008,25 +1354,46 @@ struct PlayFun {
     }
 
 #else
-    // Local version.
+    // Local version. One piece of work per next, run on the
+    // forked workers; see DoWork.
+    vector<string> requests(nexts.size());
     for (int i = 0; i < nexts.size(); i++) {
-      double immediate_score, best_future_score, worst_future_score,
-	futures_score;
-      vector<double> futurescores(NFUTURES, 0.0);
-      InnerLoop(nexts[i],
-		futures,
-		current_state,
-		&immediate_score,
-		&best_future_score,
-		&worst_future_score,
-		&futures_score,
-		&futurescores);
-
-      for (int f = 0; f < futurescores.size(); f++) {
-	(*futuretotals)[f] += futurescores[f];
+      WorkerPool::Writer w(&requests[i]);
+      w.Int(WORK_PLAYFUN);
+      w.Bytes(*current_state);
+      w.Bytes(nexts[i]);
+      w.Int(futures.size());
+      for (int f = 0; f < futures.size(); f++) {
+	w.Bytes(futures[f].inputs);
+      }
+    }
+
+    vector<string> responses;
+    NextBounds bounds;
+    workers->RunAll(requests, &responses, &bounds);
+
+    int abandoned = 0;
+    int64 skipped = 0;
+    for (int i = 0; i < responses.size(); i++) {
+      WorkerPool::Reader r(responses[i]);
+      const double immediate_score = r.Double();
+      // Best future score is unused.
+      (void)r.Double();
+      const double worst_future_score = r.Double();
+      const double futures_score = r.Double();
+      const int nscores = r.Int();
+      CHECK(nscores == futuretotals->size());
+      for (int f = 0; f < nscores; f++) {
+	(*futuretotals)[f] += r.Double();
+      }
+      const int next_skipped = r.Int();
+      CHECK(r.Done());
+      if (next_skipped > 0) {
+	abandoned++;
+	skipped += next_skipped;
       }
 
-      double score = immediate_score + futures_score;
+      const double score = immediate_score + futures_score;
 
       distribution.immediates.push_back(immediate_score);
       distribution.positives.push_back(futures_score);
@@ -1040,6 +1407,11 @@ struct PlayFun {
 	*best_next_idx = i;
       }
     }
+
+    if (ABANDON_HOPELESS) {
+      fprintf(stderr, "Abandoned %d of %d nexts, skipping %lld inputs.\n",
+	      abandoned, (int)nexts.size(), (long long)skipped);
+    }
 #endif
     distribution.chosen_idx = *best_next_idx;
     distributions.push_back(distribution);
@@ -1049,15 +1421,96 @@ struct PlayFun {
 	    (int)(end_time - start_time));
   }
 
+  // Kinds of work for the local workers, which play the role of
+  // the HelperRequest protos for MARIONET helpers.
+  enum WorkKind {
+    WORK_PLAYFUN = 0,
+    WORK_TRYIMPROVE = 1,
+  };
+
+  // Called in a worker process for requests made by ParallelStep
+  // and TryImprove.
+  void DoWork(const string &request, string *response) {
+    WorkerPool::Reader r(request);
+    WorkerPool::Writer w(response);
+    const int kind = r.Int();
+    if (kind == WORK_PLAYFUN) {
+      vector<uint8> current_state, next;
+      r.Bytes(&current_state);
+      r.Bytes(&next);
+      vector<Future> futures(r.Int());
+      for (int i = 0; i < futures.size(); i++) {
+	r.Bytes(&futures[i].inputs);
+      }
+      // Added by NextBounds.
+      const double abandon_below = r.Double();
+      CHECK(r.Done());
+
+      double immediate_score, best_future_score, worst_future_score,
+	futures_score;
+      vector<double> futurescores(futures.size(), 0.0);
+      int skipped;
+      InnerLoop(next, futures, &current_state, abandon_below,
+		&immediate_score, &best_future_score,
+		&worst_future_score, &futures_score,
+		&futurescores, &skipped);
+
+      w.Double(immediate_score);
+      w.Double(best_future_score);
+      w.Double(worst_future_score);
+      w.Double(futures_score);
+      w.Int(futurescores.size());
+      for (int i = 0; i < futurescores.size(); i++) {
+	w.Double(futurescores[i]);
+      }
+      w.Int(skipped);
+
+    } else if (kind == WORK_TRYIMPROVE) {
+      const int approach = r.Int();
+      const string seed = r.String();
+      const int iters = r.Int();
+      const int maxbest = r.Int();
+      vector<uint8> start_state, end_state, improveme;
+      r.Bytes(&start_state);
+      r.Bytes(&end_state);
+      const double end_integral = r.Double();
+      r.Bytes(&improveme);
+      CHECK(r.Done());
+
+      // No in-place progress, since all the workers share
+      // the terminal.
+      vector< pair< double, vector<uint8> > > repls;
+      const int nimproved = DoTryImprove(NULL, approach, seed,
+					 iters, maxbest,
+					 &start_state, &end_state,
+					 end_integral, improveme,
+					 &repls);
+
+      w.Int(nimproved);
+      w.Int(repls.size());
+      for (int i = 0; i < repls.size(); i++) {
+	w.Double(repls[i].first);
+	w.Bytes(repls[i].second);
+      }
+
+    } else {
+      fprintf(stderr, "Unknown kind of work %d.\n", kind);
+      abort();
+    }
+  }
+
   void PopulateFutures(vector<Future> *futures) {
-    int num_currently_weighted = 0;
+    int num_currently_weighted = 0, num_currently_markov = 0;
     for (int i = 0; i < futures->size(); i++) {
       if ((*futures)[i].weighted) {
 	num_currently_weighted++;
+      } else if ((*futures)[i].markov) {
+	num_currently_markov++;
       }
     }
 
     int num_to_weight = max(NWEIGHTEDFUTURES - num_currently_weighted, 0);
+    int num_to_markov = max(NMARKOVFUTURES - num_currently_markov, 0);
     #ifdef DEBUGFUTURES
     fprintf(stderr, "there are %d futures, %d cur weighted, %d need\n",
 	    futures->size(), num_currently_weighted, num_to_weight);
@@ -1074,6 +1527,9 @@ struct PlayFun {
       if (num_to_weight > 0) {
 	futures->push_back(Future(true, flength));
 	num_to_weight--;
+      } else if (num_to_markov > 0) {
+	futures->push_back(Future(false, flength, true));
+	num_to_markov--;
       } else {
 	futures->push_back(Future(false, flength));
       }
@@ -1082,13 +1538,20 @@ struct PlayFun {
     // Make sure we have enough futures with enough data in.
     // PERF: Should avoid creating exact duplicate futures.
     for (int i = 0; i < NFUTURES; i++) {
+      if (!(*futures)[i].weighted && (*futures)[i].markov) {
+	markov->Extend(&rc, (*futures)[i].desired_length,
+		       &(*futures)[i].inputs);
+	continue;
+      }
+
       while ((*futures)[i].inputs.size() <
 	     (*futures)[i].desired_length) {
-	const vector<uint8> &m =
+	const int id =
 	  (*futures)[i].weighted ?
-	  motifs->RandomWeightedMotif() :
-	  motifs->RandomMotif();
-	for (int x = 0; x < m.size(); x++) {
+	  motifs->RandomWeightedMotifId() :
+	  motifs->RandomMotifId();
+	const uint8 *m = motifs->Inputs(id);
+	for (int x = 0; x < motifs->Length(id); x++) {
 	  (*futures)[i].inputs.push_back(m[x]);
 	  if ((*futures)[i].inputs.size() ==
 	      (*futures)[i].desired_length) {
@@ -1101,7 +1564,7 @@ struct PlayFun {
     #ifdef DEBUGFUTURES
     for (int f = 0; f < futures->size(); f++) {
       fprintf(stderr, "%d. %s %d/%d: ...\n",
-	      f, (*futures)[f].weighted ? "weighted" : "random",
+	      f, (*futures)[f].Kind(),
 	      (*futures)[f].inputs.size(),
 	      (*futures)[f].desired_length);
     }
@@ -1112,6 +1575,7 @@ struct PlayFun {
     Future out;
     out.is_mutant = true;
     out.weighted = input.weighted;
+    out.markov = input.markov;
     if ((rc.Byte() & 7) == 0) out.weighted = !out.weighted;
     out.inputs = input.inputs;
 
@@ -1238,29 +1702,28 @@ struct PlayFun {
     // This should be a motif in the normal case where we're trying
     // each motif, but when we use this to implement the best
     // backtrack plan, it usually won't be.
-    if (motifs->IsMotif(nexts[best_next_idx])) {
+    const int motif_id = motifs->GetId(nexts[best_next_idx]);
+    if (motif_id >= 0) {
       double total = motifs->GetTotalWeight();
-      motifs->Pick(nexts[best_next_idx]);
+      motifs->Pick(motif_id);
       vector<uint8> new_memory;
       Emulator::GetMemory(&new_memory);
       double oldval = objectives->GetNormalizedValue(current_memory);
       double newval = objectives->GetNormalizedValue(new_memory);
-      double *weight = motifs->GetWeightPtr(nexts[best_next_idx]);
-      // Already checked it's a motif.
-      CHECK(weight != NULL);
+      const double weight = motifs->GetWeight(motif_id);
       if (newval > oldval) {
 	// Increases its weight.
-	double d = *weight / MOTIF_ALPHA;
+	double d = weight / MOTIF_ALPHA;
 	if (d / total < MOTIF_MAX_FRAC) {
-	  *weight = d;
+	  motifs->SetWeight(motif_id, d);
 	} else {
 	  fprintf(stderr, "motif is already at max frac: %.2f\n", d);
 	}
       } else {
 	// Decreases its weight.
-	double d = *weight * MOTIF_ALPHA;
+	double d = weight * MOTIF_ALPHA;
 	if (d / total > MOTIF_MIN_FRAC) {
-	  *weight = d;
+	  motifs->SetWeight(motif_id, d);
 	} else {
 	  fprintf(stderr, "motif is already at min frac: %f\n", d);
 	}
@@ -1270,6 +1733,21 @@ struct PlayFun {
     PopulateFutures(futures);
   }
 
+  // Forks the local workers, which without MARIONET do the work of
+  // ParallelStep and TryImprove. They get a copy of everything as it
+  // is now, so this should be done after warmup and before any
+  // other output is buffered. Does nothing if already started.
+  void StartWorkers(int num) {
+    if (workers != NULL) return;
+    // Each worker gets its own copy of the prefix cache, which is
+    // still empty, so split the edges between them. That keeps the
+    // total for the workers at PREFIX_CACHE_EDGES, plus one share
+    // for the copy that the master keeps.
+    delete prefix_cache;
+    prefix_cache = new PrefixCache(10, max(1, PREFIX_CACHE_EDGES / num));
+    workers = new WorkerPool(num, this);
+  }
+
   // Main loop for the master, or when compiled without MARIONET support.
   // Helpers is an array of helper ports, which is ignored unless MARIONET
   // is active.
@@ -1277,6 +1755,10 @@ struct PlayFun {
     // XXX
     ports_ = helpers;
 
+    #if !MARIONET
+    StartWorkers(WorkerPool::NumProcessors());
+    #endif
+
     log = fopen(GAME "-log.html", "w");
     CHECK(log != NULL);
     fprintf(log,
@@ -1378,13 +1860,13 @@ struct PlayFun {
     // There may be duplicates (typical, in fact). Insert motifs
     // as long as we can.
     while (todo.size() < NFUTURES) {
-      const vector<uint8> *motif = motifs->RandomWeightedMotifNotIn(todo);
-      if (motif == NULL) {
+      const int id = motifs->RandomWeightedMotifNotIn(todo);
+      if (id < 0) {
 	fprintf(stderr, "No more motifs (have %d todo).\n", todo.size());
 	break;
       }
 
-      todo.insert(make_pair(*motif, "backfill"));
+      todo.insert(make_pair(motifs->GetInputs(id), "backfill"));
     }
 
     // Now populate nexts and explanations.
@@ -1397,6 +1879,22 @@ struct PlayFun {
     }
   }
 
+  // One TryImprove job, which runs on a helper or worker.
+  struct ImproveJob {
+    ImproveJob(int approach, int iters, const string &seed)
+      : approach(approach), iters(iters), seed(seed) {}
+    // Describes where a replacement came from.
+    string Method() const {
+      return StringPrintf("%s-%d-%s",
+			  ApproachName(approach).c_str(),
+			  iters,
+			  seed.c_str());
+    }
+    int approach;
+    int iters;
+    string seed;
+  };
+
   void TryImprove(Checkpoint *start,
 		  const vector<uint8> &improveme,
 		  const vector<uint8> &current_state,
@@ -1436,7 +1934,33 @@ struct PlayFun {
     static const int OPPOSITES_ITERS = 200;
 
 
-    #ifdef MARIONET
+    // One job per approach and seed.
+    vector<ImproveJob> jobs;
+    if (TRY_OPPOSITES) {
+      jobs.push_back(ImproveJob(IMPROVE_OPPOSITES, OPPOSITES_ITERS,
+				StringPrintf("opp%d", start->movenum)));
+    }
+
+    for (int i = 0; i < NUM_ABLATION; i++) {
+      jobs.push_back(ImproveJob(IMPROVE_ABLATION, ABLATION_ITERS,
+				StringPrintf("abl%d.%d", start->movenum, i)));
+    }
+
+    for (int i = 0; i < NUM_CHOP; i++) {
+      jobs.push_back(ImproveJob(IMPROVE_CHOP, CHOP_ITERS,
+				StringPrintf("chop%d.%d", start->movenum, i)));
+    }
+
+    for (int i = 0; i < NUM_IMPROVE_RANDOM; i++) {
+      jobs.push_back(ImproveJob(IMPROVE_RANDOM, RANDOM_ITERS,
+				StringPrintf("seed%d.%d", start->movenum, i)));
+    }
+
+    // Number of improvements and tries, for each job in the
+    // same order.
+    vector<int> better(jobs.size(), 0), tried(jobs.size(), 0);
+
+    #if MARIONET
 
     // One piece of work per request.
     vector<HelperRequest> requests;
@@ -1449,44 +1973,11 @@ struct PlayFun {
     base_req.set_end_integral(current_integral);
     base_req.set_maxbest(MAXBEST);
 
-    if (TRY_OPPOSITES) {
-      TryImproveRequest req = base_req;
-      req.set_approach(TryImproveRequest::OPPOSITES);
-      req.set_iters(OPPOSITES_ITERS);
-      req.set_seed(StringPrintf("opp%d", start->movenum));
-
-      HelperRequest hreq;
-      hreq.mutable_tryimprove()->MergeFrom(req);
-      requests.push_back(hreq);
-    }
-
-    for (int i = 0; i < NUM_ABLATION; i++) {
-      TryImproveRequest req = base_req;
-      req.set_iters(ABLATION_ITERS);
-      req.set_seed(StringPrintf("abl%d.%d", start->movenum, i));
-      req.set_approach(TryImproveRequest::ABLATION);
-
-      HelperRequest hreq;
-      hreq.mutable_tryimprove()->MergeFrom(req);
-      requests.push_back(hreq);
-    }
-
-    for (int i = 0; i < NUM_CHOP; i++) {
-      TryImproveRequest req = base_req;
-      req.set_iters(CHOP_ITERS);
-      req.set_seed(StringPrintf("chop%d.%d", start->movenum, i));
-      req.set_approach(TryImproveRequest::CHOP);
-
-      HelperRequest hreq;
-      hreq.mutable_tryimprove()->MergeFrom(req);
-      requests.push_back(hreq);
-    }
-
-    for (int i = 0; i < NUM_IMPROVE_RANDOM; i++) {
+    for (int i = 0; i < jobs.size(); i++) {
       TryImproveRequest req = base_req;
-      req.set_iters(RANDOM_ITERS);
-      req.set_seed(StringPrintf("seed%d.%d", start->movenum, i));
-      req.set_approach(TryImproveRequest::RANDOM);
+      req.set_approach((TryImproveRequest::Approach)jobs[i].approach);
+      req.set_iters(jobs[i].iters);
+      req.set_seed(jobs[i].seed);
 
       HelperRequest hreq;
       hreq.mutable_tryimprove()->MergeFrom(req);
@@ -1501,41 +1992,75 @@ struct PlayFun {
 			    TryImproveResponse>::Work> &work =
       getanswers.GetWork();
 
-    fprintf(log, "<li>Attempts at improving:\n<ul>");
-    int numer = 0, denom = 0;
+    // Work comes back in the same order as the requests.
+    CHECK(work.size() == jobs.size());
     for (int i = 0; i < work.size(); i++) {
-      const TryImproveRequest &req = work[i].req->tryimprove();
       const TryImproveResponse &res = work[i].res;
       CHECK(res.score_size() == res.inputs_size());
       for (int j = 0; j < res.inputs_size(); j++) {
 	Replacement r;
-	r.method =
-	  StringPrintf("%s-%d-%s",
-		       TryImproveRequest::Approach_Name(req.approach()).c_str(),
-		       req.iters(),
-		       req.seed().c_str());
+	r.method = jobs[i].Method();
 	ReadBytesFromProto(res.inputs(j), &r.inputs);
 	r.score = res.score(j);
 	replacements->push_back(r);
       }
 
+      better[i] = res.iters_better();
+      tried[i] = res.iters_tried();
+    }
+
+    #else
+
+    // Local version, on the forked workers; see DoWork.
+    vector<string> requests(jobs.size());
+    for (int i = 0; i < jobs.size(); i++) {
+      WorkerPool::Writer w(&requests[i]);
+      w.Int(WORK_TRYIMPROVE);
+      w.Int(jobs[i].approach);
+      w.String(jobs[i].seed);
+      w.Int(jobs[i].iters);
+      w.Int(MAXBEST);
+      w.Bytes(start->save);
+      w.Bytes(current_state);
+      w.Double(current_integral);
+      w.Bytes(improveme);
+    }
+
+    vector<string> responses;
+    workers->RunAll(requests, &responses);
+
+    for (int i = 0; i < responses.size(); i++) {
+      WorkerPool::Reader r(responses[i]);
+      better[i] = r.Int();
+      tried[i] = jobs[i].iters;
+      const int nrepls = r.Int();
+      for (int j = 0; j < nrepls; j++) {
+	Replacement repl;
+	repl.method = jobs[i].Method();
+	repl.score = r.Double();
+	r.Bytes(&repl.inputs);
+	replacements->push_back(repl);
+      }
+      CHECK(r.Done());
+    }
+
+    #endif
+
+    fprintf(log, "<li>Attempts at improving:\n<ul>");
+    int numer = 0, denom = 0;
+    for (int i = 0; i < jobs.size(); i++) {
       fprintf(log, "<li>%s: %d/%d</li>\n",
-	      TryImproveRequest::Approach_Name(req.approach()).c_str(),
-	      res.iters_better(),
-	      res.iters_tried());
+	      ApproachName(jobs[i].approach).c_str(),
+	      better[i],
+	      tried[i]);
 
-      numer += res.iters_better();
-      denom += res.iters_tried();
+      numer += better[i];
+      denom += tried[i];
     }
     fprintf(log, "</ul></li><li> ... (total %d/%d = %.1f%%)</li>\n",
 	    numer, denom, (100.0 * numer) / denom);
     *improvability = (double)numer / denom;
 
-    #else
-    // This is optional, so if there's no MARIONET, skip for now.
-    fprintf(stderr, "TryImprove requires MARIONET...\n");
-    #endif
-
     uint64 end_time = time(NULL);
     fprintf(stderr, "TryImprove took %d seconds.\n",
 	    (int)(end_time - start_time));
@@ -1739,6 +2264,7 @@ struct PlayFun {
 					movie,
 					subtitles);
     Emulator::PrintCacheStats();
+    prefix_cache->PrintStats();
   }
 
   void SaveQuickDiagnostics(const vector<Future> &futures) {
@@ -1773,6 +2299,17 @@ struct PlayFun {
   // Ports for the helpers.
   vector<int> ports_;
 
+  // Local workers, when compiled without MARIONET.
+  WorkerPool *workers;
+
+  // Results of playing input sequences, for ScoreIntegral.
+  PrefixCache *prefix_cache;
+  // The memories after each step of a chunk in ScoreIntegral. Kept
+  // so that it doesn't need to allocate them.
+  vector<uint8> step_memories;
+  // The final memory of each future in InnerLoop, one after another.
+  vector<uint8> future_memories;
+
   // For making SVG.
   vector<Scoredist> distributions;
 
@@ -1784,12 +2321,15 @@ struct PlayFun {
   WeightedObjectives *objectives;
   Motifs *motifs;
   vector< vector<uint8> > motifvec;
+  // Only if NMARKOVFUTURES > 0.
+  Markov *markov;
 };
 
 // Fixes Linux/GNU linker undefined reference error, not sure why.
 // playfun.cc:(.text+0x33ad): undefined reference to `PlayFun::MINFUTURELENGTH'
 // http://stackoverflow.com/questions/5508182/static-const-int-causes-linking-error-undefined-reference
 const int PlayFun::MINFUTURELENGTH;
+const int PlayFun::PREFIX_CACHE_EDGES;
 
 /**
  * The main loop for the SDL.
@@ -1836,6 +2376,14 @@ int main(int argc, char *argv[]) {
     pf.Master(empty);
   }
   #else
+  if (argc >= 2) {
+    if (0 == strcmp(argv[1], "--workers") && argc >= 3 && atoi(argv[2]) > 0) {
+      pf.StartWorkers(atoi(argv[2]));
+    } else {
+      fprintf(stderr, "Usage: playfun [--workers N]\n");
+      abort();
+    }
+  }
   vector<int> nobody;
   pf.Master(nobody);
   #endif
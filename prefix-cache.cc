@@ -0,0 +1,124 @@
+#include "prefix-cache.h"
+
+#include <stdio.h>
+
+#include "tasbot.h"
+#include "../cc-lib/city/city.h"
+
+PrefixCache::PrefixCache(int stride, uint64 max_edges)
+  : stride(stride), max_edges(max_edges), hits(0ULL), misses(0ULL) {
+  CHECK(stride > 0);
+  CHECK(max_edges > 0);
+}
+
+PrefixCache::~PrefixCache() {
+  for (StateTable::iterator it = states.begin(); it != states.end(); ++it) {
+    delete it->second;
+  }
+}
+
+PrefixCache::Node PrefixCache::NodeFor(const vector<uint8> &state) {
+  CHECK(!state.empty());
+  return CityHash128((const char *)&state[0], state.size());
+}
+
+size_t PrefixCache::EdgeHash::operator ()(const EdgeKey &k) const {
+  return k.first.first ^
+    CityHash64((const char *)&k.second[0], k.second.size());
+}
+
+int PrefixCache::Follow(Node *node, const vector<uint8> &inputs,
+			vector<double> *values, vector<uint8> *state,
+			vector<Node> *nodes) {
+  int done = 0;
+  EdgeKey key;
+  key.second.resize(stride);
+  while (done + stride <= inputs.size()) {
+    key.first = *node;
+    for (int i = 0; i < stride; i++) key.second[i] = inputs[done + i];
+    EdgeTable::iterator it = edges.find(key);
+    if (it == edges.end()) {
+      misses++;
+      break;
+    }
+
+    hits++;
+    Edge *edge = &it->second;
+    lru.splice(lru.begin(), lru, edge->lru);
+    values->insert(values->end(), edge->values.begin(), edge->values.end());
+    *node = edge->to;
+    if (nodes != NULL) nodes->push_back(*node);
+    done += stride;
+  }
+
+  if (done > 0) {
+    StateTable::const_iterator it = states.find(*node);
+    CHECK(it != states.end());
+    *state = it->second->state;
+  }
+  return done;
+}
+
+PrefixCache::Node PrefixCache::Add(const Node &from, const uint8 *inputs,
+				   const vector<uint8> &state,
+				   const double *values) {
+  const EdgeKey key(from, vector<uint8>(inputs, inputs + stride));
+  EdgeTable::iterator it = edges.find(key);
+  if (it != edges.end()) {
+    // Already known; this is the same as a hit.
+    lru.splice(lru.begin(), lru, it->second.lru);
+    return it->second.to;
+  }
+
+  const Node to = NodeFor(state);
+  StateTable::iterator sit = states.find(to);
+  if (sit == states.end()) {
+    sit = states.insert(make_pair(to, new State(state))).first;
+  }
+  sit->second->refs++;
+
+  lru.push_front(key);
+  Edge *edge = &edges[key];
+  edge->to = to;
+  edge->values.assign(values, values + stride);
+  edge->lru = lru.begin();
+
+  while (edges.size() > max_edges) Evict();
+  return to;
+}
+
+void PrefixCache::Evict() {
+  CHECK(!lru.empty());
+  EdgeTable::iterator it = edges.find(lru.back());
+  CHECK(it != edges.end());
+  lru.pop_back();
+  Release(it->second.to);
+  edges.erase(it);
+}
+
+// Note that the state can outlive all of the edges from it, and
+// edges can outlive the state they start from; neither is a problem
+// since we only need the state at the end of a path.
+void PrefixCache::Release(const Node &node) {
+  StateTable::iterator it = states.find(node);
+  CHECK(it != states.end());
+  CHECK(it->second->refs > 0);
+  it->second->refs--;
+  if (it->second->refs == 0) {
+    delete it->second;
+    states.erase(it);
+  }
+}
+
+void PrefixCache::PrintStats() const {
+  uint64 bytes = 0ULL;
+  for (StateTable::const_iterator it = states.begin();
+       it != states.end(); ++it) {
+    bytes += it->second->state.size();
+  }
+  printf("Prefix cache: %llu / %llu edges of %d, %llu states (%.2f MB)\n"
+	 "%llu hits and %llu misses\n",
+	 (uint64)edges.size(), max_edges, stride, (uint64)states.size(),
+	 bytes / (1024.0 * 1024.0),
+	 hits, misses);
+}
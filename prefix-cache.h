@@ -0,0 +1,110 @@
+/* Cache of the results of playing sequences of inputs, organized
+   as a trie so that sequences with a shared prefix share nodes.
+
+   The emulator's state cache (Emulator::CachingStep) remembers
+   single steps, so replaying an 800-input sequence that's entirely
+   cached still takes 800 saves, hashes, lookups and loads. Here,
+   nodes are emulator states (identified by a hash of their contents)
+   and edges are chunks of a fixed number of inputs (the stride), so
+   following a cached prefix is just a lookup per chunk, and only the
+   state at the end of it needs to be loaded. Each edge also keeps one
+   value per input for the client, like the objective score of each
+   step, so that those don't need to be recomputed either.
+
+   Since nodes are identified by state, any state that has been
+   reached along some sequence can be the start of another; it
+   doesn't matter what sequence got there. */
+
+#ifndef __PREFIX_CACHE_H
+#define __PREFIX_CACHE_H
+
+#include <vector>
+#include <list>
+#include <utility>
+#ifdef __GNUC__
+#include <tr1/unordered_map>
+using std::tr1::unordered_map;
+#else
+#include <unordered_map>
+#endif
+
+#include "tasbot.h"
+
+struct PrefixCache {
+  // Identifies a node by the 128-bit hash of its (uncompressed) state.
+  typedef pair<uint64, uint64> Node;
+
+  // Edges are stride inputs long. Keeps at most max_edges edges
+  // (and as many states), evicting the least recently used.
+  PrefixCache(int stride, uint64 max_edges);
+  ~PrefixCache();
+
+  int Stride() const { return stride; }
+
+  static Node NodeFor(const vector<uint8> &state);
+
+  // Follows whole chunks of inputs from the start, beginning at the
+  // node, as far as they are cached. Returns the number of inputs
+  // covered, which is a multiple of the stride. Sets node to the last
+  // node reached and appends the values for the covered inputs. If
+  // any inputs were covered, copies the state at that node into state.
+  // If nodes is non-NULL, also appends the node after each chunk.
+  int Follow(Node *node, const vector<uint8> &inputs,
+	     vector<double> *values, vector<uint8> *state,
+	     vector<Node> *nodes = NULL);
+
+  // Records that playing the stride inputs starting at inputs,
+  // from the state at node, yields the state, with one value per
+  // input. Returns the node for the state.
+  Node Add(const Node &from, const uint8 *inputs,
+	   const vector<uint8> &state, const double *values);
+
+  void PrintStats() const;
+
+ private:
+  // Start node and the inputs along the edge.
+  typedef pair<Node, vector<uint8> > EdgeKey;
+  // Edges from most to least recently used.
+  typedef list<EdgeKey> LRU;
+
+  struct Edge {
+    Node to;
+    vector<double> values;
+    LRU::iterator lru;
+  };
+
+  struct State {
+    State(const vector<uint8> &state) : state(state), refs(0) {}
+    vector<uint8> state;
+    // Number of edges that lead here.
+    int refs;
+  };
+
+  struct EdgeHash {
+    size_t operator ()(const EdgeKey &k) const;
+  };
+  struct NodeHash {
+    size_t operator ()(const Node &n) const {
+      // Already a good hash.
+      return n.first;
+    }
+  };
+
+  typedef unordered_map<EdgeKey, Edge, EdgeHash> EdgeTable;
+  typedef unordered_map<Node, State *, NodeHash> StateTable;
+
+  void Evict();
+  void Release(const Node &node);
+
+  const int stride;
+  const uint64 max_edges;
+  EdgeTable edges;
+  StateTable states;
+  LRU lru;
+
+  uint64 hits, misses;
+
+  NOT_COPYABLE(PrefixCache);
+};
+
+#endif
@@ -425,14 +425,31 @@ int main(int argc, char *argv[]) {
 
     Shuffle(&next);
 
+    // Effective inputs (see Emulator::InputMask) that we've already
+    // tried from this node, as (mask, input & mask). An input that
+    // agrees with one of them on its mask leads to the same state,
+    // so there's no need to replay the node for it. On lag frames
+    // this skips all but the first.
+    vector< pair<uint8, uint8> > tried;
     for (int n = 0; n < next.size(); n++) {
       uint8 input = next[n];
+      bool equivalent = false;
+      for (int t = 0; t < tried.size(); t++) {
+        if ((input & tried[t].first) == tried[t].second) {
+          equivalent = true;
+          break;
+        }
+      }
+      if (equivalent) continue;
+
       // Only way to try a new input is to load the explore node
       // and make a step.
       // PERF: Should probably have LoadNode return the save state
       // so that we don't have to keep replaying.
       LoadNode(explore);
       Emulator::Step(input);
+      const uint8 mask = Emulator::InputMask();
+      tried.push_back(make_pair(mask, (uint8)(input & mask)));
 
       // Did we win?
       if (IsWon()) {
@@ -2,7 +2,8 @@
 #include "weighted-objectives.h"
 
 #include <algorithm>
-#include <set>
+#include <math.h>
+#include <string.h>
 #include <string>
 #include <iostream>
 #include <sstream>
@@ -14,20 +15,144 @@
 
 using namespace std;
 
+// An objective's value in a memory is the bytes at its locations,
+// compared lexicographically. Objectives with up to this many
+// locations pack them into an integer instead, big-endian, which
+// compares the same way and doesn't need to be allocated. Longer ones
+// use a vector of the bytes.
+static const int MAX_PACKED = 8;
+
+static inline void GetValue(const uint8 *mem, const vector<int> &obj,
+			    uint64 *value) {
+  uint64 v = 0;
+  for (int i = 0; i < obj.size(); i++) {
+    v = (v << 8) | mem[obj[i]];
+  }
+  *value = v;
+}
+
+static inline void GetValue(const uint8 *mem, const vector<int> &obj,
+			    vector<uint8> *value) {
+  value->resize(obj.size());
+  for (int i = 0; i < obj.size(); i++) {
+    (*value)[i] = mem[obj[i]];
+  }
+}
+
+// Objectives keep at most this many distinct observed values.
+static const int MAX_OBSERVED_VALUES = 1024;
+
+// The distinct values observed for an objective, sorted ascending,
+// and how many times each was observed. When there get to be too
+// many, runs of neighboring values are merged into the smallest one,
+// so that memory stays bounded; ranks are approximate after that.
+template<class V>
+struct Observed {
+  vector<V> values;
+  vector<int64> counts;
+  // Fenwick tree over counts, for computing ranks in log time.
+  vector<int64> tree;
+
+  void Observe(const V &value) {
+    const int idx =
+      lower_bound(values.begin(), values.end(), value) - values.begin();
+    if (idx < values.size() && values[idx] == value) {
+      // The usual case, once the objective has been observed a while.
+      counts[idx]++;
+      for (int i = idx + 1; i <= tree.size(); i += i & -i) {
+	tree[i - 1]++;
+      }
+      return;
+    }
+
+    values.insert(values.begin() + idx, value);
+    counts.insert(counts.begin() + idx, 1);
+    if (values.size() > MAX_OBSERVED_VALUES) {
+      // Merge runs of neighbors into the first of them, as long as
+      // the run has at most about 4/MAX_OBSERVED_VALUES of the
+      // observations. Each two consecutive runs have more than that,
+      // so this at least halves the number of values, and no value
+      // stands for so many observations that ranks get far off.
+      int64 total = 0;
+      for (int i = 0; i < counts.size(); i++) total += counts[i];
+      const int64 most = total * 4 / MAX_OBSERVED_VALUES;
+      int out = 0;
+      for (int i = 0; i < values.size(); i++) {
+	if (out > 0 && counts[out - 1] + counts[i] <= most) {
+	  counts[out - 1] += counts[i];
+	} else {
+	  std::swap(values[out], values[i]);
+	  counts[out] = counts[i];
+	  out++;
+	}
+      }
+      values.resize(out);
+      counts.resize(out);
+    }
+
+    // Rebuild the tree, in linear time.
+    tree = counts;
+    for (int i = 1; i <= tree.size(); i++) {
+      const int parent = i + (i & -i);
+      if (parent <= tree.size()) tree[parent - 1] += tree[i - 1];
+    }
+  }
+
+  // Number of observations less than the value.
+  int64 Rank(const V &value) const {
+    const int idx =
+      lower_bound(values.begin(), values.end(), value) - values.begin();
+    int64 rank = 0;
+    for (int i = idx; i > 0; i -= i & -i) {
+      rank += tree[i - 1];
+    }
+    return rank;
+  }
+};
+
 struct WeightedObjectives::Info {
-  explicit Info(double w) : weight(w) {}
+  explicit Info(double w) : weight(w), num_observations(0) {}
   double weight;
 
-  // Sorted, ascending.
-  vector< vector<uint8> > observations;
+  // Only one of these is used, depending on the objective's length.
+  Observed<uint64> packed;
+  Observed< vector<uint8> > unpacked;
+  int64 num_observations;
+
+  void Observe(const uint8 *mem, const vector<int> &obj) {
+    num_observations++;
+    if (obj.size() <= MAX_PACKED) {
+      uint64 value;
+      GetValue(mem, obj, &value);
+      packed.Observe(value);
+    } else {
+      vector<uint8> value;
+      GetValue(mem, obj, &value);
+      unpacked.Observe(value);
+    }
+  }
+
+  int64 Rank(const uint8 *mem, const vector<int> &obj) const {
+    if (obj.size() <= MAX_PACKED) {
+      uint64 value;
+      GetValue(mem, obj, &value);
+      return packed.Rank(value);
+    } else {
+      vector<uint8> value;
+      GetValue(mem, obj, &value);
+      return unpacked.Rank(value);
+    }
+  }
 };
 
-WeightedObjectives::WeightedObjectives() {}
+WeightedObjectives::WeightedObjectives() : total_weight(0.0), num_words(0) {}
 
-WeightedObjectives::WeightedObjectives(const vector< vector<int> > &objs) {
+WeightedObjectives::WeightedObjectives(const vector< vector<int> > &objs)
+  : total_weight(0.0), num_words(0) {
   for (int i = 0; i < objs.size(); i++) {
     weighted[objs[i]] = new Info(1.0);
   }
+  Compile();
 }
 
 static string ObjectiveToString(const vector<int> &obj) {
@@ -59,6 +184,7 @@ WeightedObjectives::LoadFromFile(const string &filename) {
     wo->weighted.insert(make_pair(locs, new Info(d)));
   }
 
+  wo->Compile();
   return wo;
 }
   
@@ -82,74 +208,113 @@ size_t WeightedObjectives::Size() const {
 }
 
 void WeightedObjectives::Observe(const vector<uint8> &memory) {
-  // PERF Currently, we just keep a sorted vector for each objective's
-  // value at each observation. This is not very efficient. Worse, it
-  // may have the undesirable effect that a particular state's value
-  // can change (arbitrarily) with future observations, even just by
-  // observing states we've already seen again (changes mass
-  // distribution).
   for (Weighted::iterator it = weighted.begin();
        it != weighted.end(); ++it) {
-    const vector<int> &obj = it->first;
-    Info *info = it->second;
-    info->observations.resize(info->observations.size() + 1);
-    vector<uint8> *cur = &info->observations.back();
-    cur->reserve(obj.size());
-
-    for (int i = 0; i < obj.size(); i++) {
-      cur->push_back(memory[obj[i]]);
-    }
-
-    // PERF sorted insert is O(n/2); dunno how std::sort
-    // behaves on nearly-sorted vectors.
-    std::sort(info->observations.begin(), info->observations.end());
-
-    // Maybe should just keep the unique values? Otherwise
-    // lower_bound is doing something kind of funny when there
-    // are lots of the same value...
+    it->second->Observe(&memory[0], it->first);
   }
 }
 
-static bool LessObjective(const vector<uint8> &mem1, 
-			  const vector<uint8> &mem2,
-			  const vector<int> &order) {
-  for (int i = 0; i < order.size(); i++) {
-    int p = order[i];
-    if (mem1[p] > mem2[p])
-      return false;
-    if (mem1[p] < mem2[p])
-      return true;
+// The lexicographic comparison of the memories for the objective:
+// 1 if mem1 < mem2, -1 if mem1 > mem2, and 0 if they're equal.
+static inline int Order(const uint16 *loc, const uint16 *end,
+			const uint8 *mem1, const uint8 *mem2) {
+  for (; loc != end; ++loc) {
+    const uint8 a = mem1[*loc], b = mem2[*loc];
+    if (a < b) return 1;
+    if (a > b) return -1;
   }
-
   // Equal.
-  return false;
+  return 0;
+}
+
+static inline uint64 Word(const uint8 *mem, int p) {
+  uint64 word;
+  memcpy(&word, mem + p, sizeof (word));
+  return word;
 }
 
-static int Order(const vector<uint8> &mem1, 
-		 const vector<uint8> &mem2,
-		 const vector<int> &order) {
-  for (int i = 0; i < order.size(); i++) {
-    int p = order[i];
-    if (mem1[p] > mem2[p])
-      return -1;
-    if (mem1[p] < mem2[p])
-      return 1;
+void WeightedObjectives::Compile() {
+  locs.clear();
+  starts.clear();
+  weights.clear();
+  total_weight = 0.0;
+  // Number of objectives using each location, to size the index.
+  vector<int> uses(MAX_BYTES, 0);
+  for (Weighted::const_iterator it = weighted.begin();
+       it != weighted.end(); ++it) {
+    const vector<int> &obj = it->first;
+    starts.push_back(locs.size());
+    weights.push_back(it->second->weight);
+    total_weight += fabs(it->second->weight);
+    for (int i = 0; i < obj.size(); i++) {
+      CHECK(obj[i] >= 0 && obj[i] < MAX_BYTES);
+      locs.push_back(obj[i]);
+      uses[obj[i]]++;
+    }
   }
+  starts.push_back(locs.size());
+  num_words = (weights.size() + 63) / 64;
 
-  // Equal.
-  return 0;
+  loc_starts.resize(MAX_BYTES + 1);
+  loc_starts[0] = 0;
+  for (int p = 0; p < MAX_BYTES; p++) {
+    loc_starts[p + 1] = loc_starts[p] + uses[p];
+  }
+  used_words.clear();
+  for (int p = 0; p < MAX_BYTES; p += 8) {
+    if (loc_starts[p + 8] > loc_starts[p]) used_words.push_back(p);
+  }
+  // Objectives are visited in order, so each location's list comes
+  // out sorted. An objective that uses a location twice is listed
+  // twice, which is harmless.
+  by_loc.resize(locs.size());
+  vector<int> next(loc_starts.begin(), loc_starts.end() - 1);
+  for (int i = 0; i + 1 < starts.size(); i++) {
+    for (int j = starts[i]; j < starts[i + 1]; j++) {
+      by_loc[next[locs[j]]++] = i;
+    }
+  }
 }
 
+// Between consecutive frames, only a handful of bytes change, so
+// this finds them a word at a time and marks just the objectives that
+// use them. The others compare equal and would score zero.
+void WeightedObjectives::MarkChanged(const uint8 *mem1, const uint8 *mem2,
+				     uint64 *changed) const {
+  memset(changed, 0, num_words * sizeof (uint64));
+  for (int w = 0; w < used_words.size(); w++) {
+    const int p = used_words[w];
+    if (Word(mem1, p) == Word(mem2, p)) continue;
+    for (int q = p; q < p + 8; q++) {
+      if (mem1[q] == mem2[q]) continue;
+      for (int j = loc_starts[q]; j < loc_starts[q + 1]; j++) {
+	const int i = by_loc[j];
+	changed[i >> 6] |= 1ULL << (i & 63);
+      }
+    }
+  }
+}
 
 double WeightedObjectives::WeightedLess(const vector<uint8> &mem1,
 					const vector<uint8> &mem2) const {
+  uint64 small[SMALL_WORDS];
+  vector<uint64> big;
+  uint64 *changed = small;
+  if (num_words > SMALL_WORDS) {
+    big.resize(num_words);
+    changed = &big[0];
+  }
+  MarkChanged(&mem1[0], &mem2[0], changed);
+
   double score = 0.0;
-  for (Weighted::const_iterator it = weighted.begin();
-       it != weighted.end(); ++it) {
-    const vector<int> &objective = it->first;
-    const double weight = it->second->weight;
-    if (LessObjective(mem1, mem2, objective))
-      score += weight;
+  // In ascending order of objective, like a loop over all of them.
+  for (int w = 0; w < num_words; w++) {
+    for (uint64 bits = changed[w]; bits != 0; bits &= bits - 1) {
+      const int i = w * 64 + __builtin_ctzll(bits);
+      if (Order(&locs[0] + starts[i], &locs[0] + starts[i + 1],
+		&mem1[0], &mem2[0]) > 0)
+	score += weights[i];
+    }
   }
   CHECK(score >= 0);
   return score;
@@ -157,21 +322,75 @@ double WeightedObjectives::WeightedLess(const vector<uint8> &mem1,
 
 double WeightedObjectives::Evaluate(const vector<uint8> &mem1,
 				    const vector<uint8> &mem2) const {
+  return Evaluate(&mem1[0], &mem2[0]);
+}
+
+double WeightedObjectives::Evaluate(const uint8 *mem1,
+				    const uint8 *mem2) const {
+  uint64 small[SMALL_WORDS];
+  vector<uint64> big;
+  uint64 *changed = small;
+  if (num_words > SMALL_WORDS) {
+    big.resize(num_words);
+    changed = &big[0];
+  }
+  MarkChanged(mem1, mem2, changed);
+
   double score = 0.0;
-  for (Weighted::const_iterator it = weighted.begin();
-       it != weighted.end(); ++it) {
-    const vector<int> &objective = it->first;
-    const double weight = it->second->weight;
-    switch (Order(mem1, mem2, objective)) {
-    case -1: score -= weight; break;
-    case 1: score += weight; break;
-    case 0:
-    default:;
+  for (int w = 0; w < num_words; w++) {
+    for (uint64 bits = changed[w]; bits != 0; bits &= bits - 1) {
+      const int i = w * 64 + __builtin_ctzll(bits);
+      switch (Order(&locs[0] + starts[i], &locs[0] + starts[i + 1],
+		    mem1, mem2)) {
+      case -1: score -= weights[i]; break;
+      case 1: score += weights[i]; break;
+      case 0:
+      default:;
+      }
     }
   }
   return score;
 }
 
+void WeightedObjectives::EvaluateMany(const uint8 *base, const uint8 *mems,
+				      int n, double *positive,
+				      double *negative, double *net) const {
+  for (int k = 0; k < n; k++) {
+    positive[k] = 0.0;
+    negative[k] = 0.0;
+    if (net != NULL) net[k] = 0.0;
+  }
+
+  // Objectives in the outer loop, so that each one's locations (and
+  // the base memory's values at them) are loaded once and then stay
+  // in cache for all the memories. Each score is still summed in
+  // order of objective.
+  for (int i = 0; i < weights.size(); i++) {
+    const uint16 *begin = &locs[0] + starts[i];
+    const uint16 *end = &locs[0] + starts[i + 1];
+    const double weight = weights[i];
+    for (int k = 0; k < n; k++) {
+      switch (Order(begin, end, base, mems + k * MAX_BYTES)) {
+      case -1:
+	negative[k] += weight;
+	if (net != NULL) net[k] -= weight;
+	break;
+      case 1:
+	positive[k] += weight;
+	if (net != NULL) net[k] += weight;
+	break;
+      case 0:
+      default:;
+      }
+    }
+  }
+
+  for (int k = 0; k < n; k++) {
+    CHECK(positive[k] >= 0);
+    negative[k] = -negative[k];
+  }
+}
+
 #if 0
 // XXX can probably simplify this, but should probably just remove it.
 double WeightedObjectives::BuggyEvaluate(const vector<uint8> &mem1,
@@ -193,45 +412,68 @@ double WeightedObjectives::BuggyEvaluate(const vector<uint8> &mem1,
 }
 #endif
 
-static vector<uint8> GetValues(const vector<uint8> &mem,
-			       const vector<int> &objective) {
-  vector<uint8> out;
-  out.resize(objective.size());
-  for (int i = 0; i < objective.size(); i++) {
-    CHECK(objective[i] < mem.size());
-    out[i] = mem[objective[i]];
-  }
-  return out;
-}
-
-static vector< vector<uint8> >
-GetUniqueValues(const vector< vector<uint8 > > &memories,
-		const vector<int> &objective) {
-  set< vector<uint8> > values;
+// All the distinct values the objective takes on in the memories,
+// in order.
+template<class V>
+static void GetUniqueValues(const vector< vector<uint8> > &memories,
+			    const vector<int> &objective,
+			    vector<V> *values) {
+  values->resize(memories.size());
   for (int i = 0; i < memories.size(); i++) {
-    values.insert(GetValues(memories[i], objective));
+    GetValue(&memories[i][0], objective, &(*values)[i]);
   }
-    
-  vector< vector<uint8> > uvalues;
-  uvalues.insert(uvalues.begin(), values.begin(), values.end());
-  return uvalues;
+  std::sort(values->begin(), values->end());
+  values->erase(std::unique(values->begin(), values->end()), values->end());
 }
 
-// Find the index of the vector now within the values
+// Find the index of the value now within the values
 // array, which is sorted and unique.
-static inline int GetValueIndex(const vector< vector<uint8> > &values,
-				const vector<uint8> &now) {
+template<class V>
+static inline int GetValueIndex(const vector<V> &values, const V &now) {
   return lower_bound(values.begin(), values.end(), now) - values.begin();
 }
 
-static inline double GetValueFrac(const vector< vector<uint8> > &values,
-				  const vector<uint8> &now) {
+template<class V>
+static inline double GetValueFrac(const vector<V> &values, const V &now) {
   int idx = GetValueIndex(values, now);
   // -1, since it can never be the size itself?
   // and what should the value be if values is empty or singleton?
   return (double)idx / values.size();
 }
 
+// The objective's value in the first and last memory, as a fraction
+// of the distinct values it takes on in all of them.
+template<class V>
+static void GetEndFracs(const vector< vector<uint8> > &memories,
+			const vector<int> &objective,
+			double *frac_begin, double *frac_end) {
+  vector<V> values;
+  GetUniqueValues(memories, objective, &values);
+  V value;
+  GetValue(&memories[memories.size() - 1][0], objective, &value);
+  *frac_end = GetValueFrac(values, value);
+  GetValue(&memories[0][0], objective, &value);
+  *frac_begin = GetValueFrac(values, value);
+}
+
+// The index of the objective's value in each memory among the
+// distinct values it takes on in all of them. Returns the number of
+// distinct values.
+template<class V>
+static int GetValueIndices(const vector< vector<uint8> > &memories,
+			   const vector<int> &objective,
+			   vector<int> *indices) {
+  vector<V> values;
+  GetUniqueValues(memories, objective, &values);
+  indices->resize(memories.size());
+  V value;
+  for (int i = 0; i < memories.size(); i++) {
+    GetValue(&memories[i][0], objective, &value);
+    (*indices)[i] = GetValueIndex(values, value);
+  }
+  return values.size();
+}
+
 double WeightedObjectives::GetNormalizedValue(const vector<uint8> &mem) 
   const {
   double sum = 0.0;
@@ -240,14 +482,9 @@ double WeightedObjectives::GetNormalizedValue(const vector<uint8> &mem)
        it != weighted.end(); ++it) {
     const vector<int> &obj = it->first;
     const Info &info = *it->second;
-    
-    vector<uint8> cur;
-    cur.reserve(obj.size());
-    for (int i = 0; i < obj.size(); i++) {
-      cur.push_back(mem[obj[i]]);
-    }
 
-    sum += GetValueFrac(info.observations, cur);
+    // Fraction of observations that are less.
+    sum += (double)info.Rank(&mem[0], obj) / info.num_observations;
   }
 
   sum /= (double)weighted.size();
@@ -260,16 +497,14 @@ void WeightedObjectives::WeightByExamples(const vector< vector<uint8> >
        it != weighted.end(); ++it) {
     const vector<int> &obj = it->first;
     Info *info = it->second;
-    // All the distinct values this objective takes on, in order.
-    vector< vector<uint8> > values = GetUniqueValues(memories, obj);
-
-
     // Sum of deltas is just very last - very first.
     CHECK(memories.size() > 0);
-    double score_end =
-      GetValueFrac(values, GetValues(memories[memories.size() - 1], obj));
-    double score_begin = 
-      GetValueFrac(values, GetValues(memories[0], obj));
+    double score_begin, score_end;
+    if (obj.size() <= MAX_PACKED) {
+      GetEndFracs<uint64>(memories, obj, &score_begin, &score_end);
+    } else {
+      GetEndFracs< vector<uint8> >(memories, obj, &score_begin, &score_end);
+    }
     CHECK(score_end >= 0 && score_end <= 1);
     CHECK(score_begin >= 0 && score_begin <= 1);
     double score = score_end - score_begin;
@@ -294,6 +529,64 @@ void WeightedObjectives::WeightByExamples(const vector< vector<uint8> >
       info->weight = score;
     }
   }
+  Compile();
+}
+
+// Identifies a sequence of value indices.
+static uint64 Fingerprint(const vector<int> &indices) {
+  uint64 h = indices.size();
+  for (int i = 0; i < indices.size(); i++) {
+    h ^= (uint64)indices[i];
+    h *= 0x100000001B3ULL;
+    h = (h << 29) | (h >> 35);
+  }
+  return h;
+}
+
+int WeightedObjectives::MergeEquivalent(const vector< vector<uint8> >
+					&memories) {
+  // The first objective seen with each distinct sequence, and the
+  // sequence, by fingerprint. Sequences are compared in full, so
+  // fingerprint collisions don't merge anything.
+  map< uint64, vector<int> > by_fingerprint;
+  vector<Weighted::iterator> firsts;
+  vector< vector<int> > sequences;
+  vector<Weighted::iterator> merged;
+  for (Weighted::iterator it = weighted.begin();
+       it != weighted.end(); ++it) {
+    const vector<int> &obj = it->first;
+    vector<int> indices;
+    if (obj.size() <= MAX_PACKED) {
+      GetValueIndices<uint64>(memories, obj, &indices);
+    } else {
+      GetValueIndices< vector<uint8> >(memories, obj, &indices);
+    }
+
+    vector<int> *same = &by_fingerprint[Fingerprint(indices)];
+    bool found = false;
+    for (int i = 0; i < same->size(); i++) {
+      const int f = (*same)[i];
+      if (sequences[f] == indices) {
+	firsts[f]->second->weight += it->second->weight;
+	merged.push_back(it);
+	found = true;
+	break;
+      }
+    }
+
+    if (!found) {
+      same->push_back(firsts.size());
+      firsts.push_back(it);
+      sequences.push_back(indices);
+    }
+  }
+
+  for (int i = 0; i < merged.size(); i++) {
+    delete merged[i]->second;
+    weighted.erase(merged[i]);
+  }
+  Compile();
+  return merged.size();
 }
 
 void WeightedObjectives::SaveSVG(const vector< vector<uint8> > &memories,
@@ -311,9 +604,13 @@ void WeightedObjectives::SaveSVG(const vector< vector<uint8> > &memories,
        howmany-- && it != weighted.end(); ++it) {
     const vector<int> &obj = it->first;
     const Info &info = *it->second;
-    // All the distinct values this objective takes on, in order.
-    vector< vector<uint8> > values = GetUniqueValues(memories, obj);
-    // printf("%lld distinct values for %s\n", values.size(),
+    // Index of each memory's value among all the distinct values this
+    // objective takes on, in order.
+    vector<int> indices;
+    const int num_values = obj.size() <= MAX_PACKED ?
+      GetValueIndices<uint64>(memories, obj, &indices) :
+      GetValueIndices< vector<uint8> >(memories, obj, &indices);
+    // printf("%lld distinct values for %s\n", num_values,
     // ObjectiveToString(obj).c_str());
 
     const string color = RandomColor(&rc);
@@ -336,14 +633,12 @@ void WeightedObjectives::SaveSVG(const vector< vector<uint8> > &memories,
     // Fill in points as space separated x,y coords
     int lastvalueindex = -1;
     for (int i = 0; i < memories.size(); i++) {
-      vector<uint8> now = GetValues(memories[i], obj);
-      int valueindex = GetValueIndex(values, now);
+      int valueindex = indices[i];
 
       // Allow drawing horizontal lines without interstitial points.
       if (valueindex == lastvalueindex) {
 	while (i < memories.size() - 1) {
-	  vector<uint8> next = GetValues(memories[i + 1], obj);
-	  int nextvalueindex = GetValueIndex(values, next);
+	  int nextvalueindex = indices[i + 1];
 	  if (nextvalueindex != valueindex)
 	    break;
 	  i++;
@@ -353,7 +648,7 @@ void WeightedObjectives::SaveSVG(const vector< vector<uint8> > &memories,
       lastvalueindex = valueindex;
 
 	// Fraction in [0, 1]
-      double yf = (double)valueindex / (double)values.size();
+      double yf = (double)valueindex / (double)num_values;
       double xf = (double)i / (double)memories.size();
       out += Coords(WIDTH * xf, HEIGHT * (1.0 - yf)) + " ";
       if (numleft-- == 0) {
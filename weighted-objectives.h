@@ -17,6 +17,13 @@ struct WeightedObjectives {
 
   void WeightByExamples(const vector< vector<uint8> > &memories);
 
+  // Merges objectives that rank the memories the same way (same
+  // sequence of value indices, and so the same weight from
+  // WeightByExamples) into the first of them, which gets the sum of
+  // their weights. Scores on the memories stay the same, but there
+  // are fewer objectives to evaluate. Returns the number removed.
+  int MergeEquivalent(const vector< vector<uint8> > &memories);
+
   // Does not save observations.
   void SaveToFile(const std::string &filename) const;
 
@@ -26,6 +33,10 @@ struct WeightedObjectives {
 
   size_t Size() const;
 
+  // Sum of the magnitudes of the weights, which bounds the magnitude
+  // of Evaluate and WeightedLess for any pair of memories.
+  double TotalWeight() const { return total_weight; }
+
   // Scoring function which is just the sum of the weights of
   // objectives where mem1 < mem2.
   double WeightedLess(const vector<uint8> &mem1,
@@ -35,18 +46,31 @@ struct WeightedObjectives {
   // that where mem1 < mem2 minus the number where mem1 > mem2.
   double Evaluate(const vector<uint8> &mem1,
                   const vector<uint8> &mem2) const;
+  // Same, for memories that aren't in vectors, like the output of
+  // Emulator::StepMany.
+  double Evaluate(const uint8 *mem1, const uint8 *mem2) const;
+
+  // Scores the base memory against each of n memories, which are
+  // stored one after another (0x800 bytes each) in mems. Sets
+  // positive[k] to WeightedLess(base, mem_k), negative[k] to
+  // -WeightedLess(mem_k, base), and net[k] to Evaluate(base, mem_k),
+  // exactly, but in one pass over the objectives. net may be NULL.
+  void EvaluateMany(const uint8 *base, const uint8 *mems, int n,
+                    double *positive, double *negative,
+                    double *net) const;
 
   // Observe a game state. This informs us about the values that
   // the objective functions can take on, which lets us score the
   // magnitude of their changes. Not necessary for GetNumLess() or
   // Evaluate().
   //
-  // Currently, calling this reserves (forever) memory proportional to
-  // the total size (number of positions) of the objective functions.
-  // It's also quadratic time (in the number of calls), in order to
-  // make scoring the objectives logarithmic and to try to preserve
-  // memory. It should be called for "big" state transitions during
-  // exploration, not each step of speculative search.
+  // Each objective keeps its distinct values with a count of each,
+  // so this is logarithmic in the number of distinct values, except
+  // when it sees a new one, which is linear. The number of distinct
+  // values kept is bounded, so memory is too; past that, values get
+  // merged and GetNormalizedValue becomes approximate. It should be
+  // called for "big" state transitions during exploration, not each
+  // step of speculative search.
   void Observe(const vector<uint8> &memory);
 
   // Get the (current) value of the memory in terms of observations.
@@ -64,6 +88,44 @@ struct WeightedObjectives {
   typedef std::map< std::vector<int>, Info* > Weighted;
   Weighted weighted;
 
+  // Objectives only look at memory locations below this.
+  static const int MAX_BYTES = 0x800;
+
+  // Rebuilds the compiled form below from weighted. Call whenever
+  // the objectives or their weights change.
+  void Compile();
+
+  // The objectives and weights flattened into arrays, which is how
+  // they're scored. Objective i's locations are locs[starts[i]] up
+  // to locs[starts[i + 1]], and its weight is weights[i]. They're
+  // in the same order as in weighted, so that scores are summed in
+  // the same order as they would be by iterating over the map.
+  vector<uint16> locs;
+  vector<int> starts;
+  vector<double> weights;
+  double total_weight;
+
+  // Index from memory location to the objectives that use it: for
+  // location p, the objectives' indices (into starts and weights)
+  // are by_loc[loc_starts[p]] up to by_loc[loc_starts[p + 1]], in
+  // ascending order.
+  vector<int> by_loc;
+  vector<int> loc_starts;
+  // Offsets of the aligned 8-byte words of memory that contain any
+  // location used by an objective.
+  vector<uint16> used_words;
+
+  // Number of 64-bit words in a bitmap with a bit per objective.
+  int num_words;
+  // Bitmaps up to this size go on the stack.
+  static const int SMALL_WORDS = 64;
+
+  // Sets a bit in changed (which has num_words words) for each
+  // objective that uses a location where the memories differ. The
+  // rest are equal.
+  void MarkChanged(const uint8 *mem1, const uint8 *mem2,
+                   uint64 *changed) const;
+
   NOT_COPYABLE(WeightedObjectives);
 };
 
@@ -3,14 +3,277 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <map>
+#include <algorithm>
 
 #include "tasbot.h"
 #include "fceu/types.h"
 #include "../cc-lib/util.h"
 #include "../cc-lib/arcfour.h"
 #include "weighted-objectives.h"
+#include "util.h"
 
-int main(int argc, char *argv[]) {
+// Objectives (memory locations, in order) and their weights.
+typedef map< vector<int>, double > Objs;
+
+// Straightforward versions of the scoring functions, which the
+// real ones should agree with exactly.
+static int ReferenceOrder(const vector<uint8> &mem1,
+			  const vector<uint8> &mem2,
+			  const vector<int> &obj) {
+  for (int i = 0; i < obj.size(); i++) {
+    if (mem1[obj[i]] > mem2[obj[i]]) return -1;
+    if (mem1[obj[i]] < mem2[obj[i]]) return 1;
+  }
+  return 0;
+}
+
+static double ReferenceEvaluate(const Objs &objs,
+				const vector<uint8> &mem1,
+				const vector<uint8> &mem2) {
+  double score = 0.0;
+  for (Objs::const_iterator it = objs.begin(); it != objs.end(); ++it) {
+    switch (ReferenceOrder(mem1, mem2, it->first)) {
+    case -1: score -= it->second; break;
+    case 1: score += it->second; break;
+    default:;
+    }
+  }
+  return score;
+}
+
+static double ReferenceWeightedLess(const Objs &objs,
+				    const vector<uint8> &mem1,
+				    const vector<uint8> &mem2) {
+  double score = 0.0;
+  for (Objs::const_iterator it = objs.begin(); it != objs.end(); ++it) {
+    if (ReferenceOrder(mem1, mem2, it->first) > 0)
+      score += it->second;
+  }
+  return score;
+}
+
+// Random memory that differs from mem in a few places, like the
+// next frame's.
+static vector<uint8> Perturb(ArcFour *rc, const vector<uint8> &mem) {
+  vector<uint8> out = mem;
+  const int n = RandomInt32(rc) % 8;
+  for (int i = 0; i < n; i++) {
+    // Mostly in the low locations, which the objectives use a lot.
+    const int p = (RandomInt32(rc) & 1) ? RandomInt32(rc) % 64 :
+      RandomInt32(rc) % 0x800;
+    out[p] += (RandomInt32(rc) % 5) - 2;
+  }
+  return out;
+}
+
+static void TestEvaluate() {
+  ArcFour rc("weighted-objectives_test");
+
+  Objs objs;
+  string contents;
+  for (int i = 0; i < 300; i++) {
+    vector<int> obj;
+    const int len = 1 + RandomInt32(&rc) % 6;
+    for (int j = 0; j < len; j++) {
+      const int p = (RandomInt32(&rc) & 1) ? RandomInt32(&rc) % 64 :
+	RandomInt32(&rc) % 0x800;
+      if (std::find(obj.begin(), obj.end(), p) == obj.end())
+	obj.push_back(p);
+    }
+    if (objs.find(obj) != objs.end()) continue;
+
+    // Exactly representable, so that it survives the file.
+    const double weight = (1 + RandomInt32(&rc) % 1000) / 8.0;
+    objs[obj] = weight;
+    contents += StringPrintf("%f", weight);
+    for (int j = 0; j < obj.size(); j++)
+      contents += StringPrintf(" %d", obj[j]);
+    contents += "\n";
+  }
+
+  const string filename = "weighted-objectives_test.objectives";
+  Util::WriteFile(filename, contents);
+  WeightedObjectives *wo = WeightedObjectives::LoadFromFile(filename);
+  CHECK(wo->Size() == objs.size());
+
+  vector<uint8> mem(0x800, 0);
+  for (int i = 0; i < mem.size(); i++) mem[i] = RandomInt32(&rc) & 0xFF;
+
+  for (int t = 0; t < 2000; t++) {
+    vector<uint8> next = Perturb(&rc, mem);
+    // Sometimes a completely different memory, where most
+    // objectives change.
+    if (t % 100 == 0) {
+      for (int i = 0; i < next.size(); i++) next[i] = RandomInt32(&rc) & 0xFF;
+    }
+    const double e = wo->Evaluate(mem, next);
+    const double re = ReferenceEvaluate(objs, mem, next);
+    if (e != re) {
+      fprintf(stderr, "Evaluate got %f but expected %f\n", e, re);
+      abort();
+    }
+    CHECK(wo->Evaluate(&mem[0], &next[0]) == re);
+
+    const double l = wo->WeightedLess(mem, next);
+    const double rl = ReferenceWeightedLess(objs, mem, next);
+    if (l != rl) {
+      fprintf(stderr, "WeightedLess got %f but expected %f\n", l, rl);
+      abort();
+    }
+    mem.swap(next);
+  }
+
+  fprintf(stderr, "Evaluate OK.\n");
+
+  // Scoring a batch is the same as scoring each memory.
+  static const int NUM_MEMORIES = 40;
+  vector<uint8> mems;
+  for (int k = 0; k < NUM_MEMORIES; k++) {
+    vector<uint8> m = Perturb(&rc, mem);
+    if (k % 10 == 0) {
+      for (int i = 0; i < m.size(); i++) m[i] = RandomInt32(&rc) & 0xFF;
+    }
+    mems.insert(mems.end(), m.begin(), m.end());
+  }
+  vector<double> positive(NUM_MEMORIES), negative(NUM_MEMORIES),
+    net(NUM_MEMORIES);
+  wo->EvaluateMany(&mem[0], &mems[0], NUM_MEMORIES,
+		   &positive[0], &negative[0], &net[0]);
+  for (int k = 0; k < NUM_MEMORIES; k++) {
+    vector<uint8> m(mems.begin() + k * 0x800, mems.begin() + (k + 1) * 0x800);
+    CHECK(positive[k] == wo->WeightedLess(mem, m));
+    CHECK(negative[k] == -wo->WeightedLess(m, mem));
+    CHECK(net[k] == wo->Evaluate(mem, m));
+  }
+  fprintf(stderr, "EvaluateMany OK.\n");
 
+  delete wo;
+  unlink(filename.c_str());
+}
+
+// Like GetNormalizedValue, with all of the observations kept.
+static double ReferenceNormalizedValue(const vector< vector<int> > &objs,
+				       const vector< vector<uint8> > &observed,
+				       const vector<uint8> &mem) {
+  double sum = 0.0;
+  for (int o = 0; o < objs.size(); o++) {
+    int64 less = 0;
+    for (int i = 0; i < observed.size(); i++) {
+      if (ReferenceOrder(observed[i], mem, objs[o]) > 0) less++;
+    }
+    sum += (double)less / observed.size();
+  }
+  return sum / objs.size();
+}
+
+static void TestObserve() {
+  ArcFour rc("observe");
+
+  // In map order, like the objectives themselves.
+  Objs sorted;
+  for (int i = 0; i < 10; i++) {
+    vector<int> obj;
+    // Short (packed) and long objectives; the long ones see more
+    // distinct values than are kept.
+    const int len = 1 + RandomInt32(&rc) % 12;
+    for (int j = 0; j < len; j++) obj.push_back(RandomInt32(&rc) % 64);
+    sorted[obj] = 1.0;
+  }
+  vector< vector<int> > objs;
+  for (Objs::const_iterator it = sorted.begin(); it != sorted.end(); ++it)
+    objs.push_back(it->first);
+
+  WeightedObjectives wo(objs);
+  vector< vector<uint8> > observed;
+  vector<uint8> mem(0x800, 0);
+  for (int t = 0; t < 500; t++) {
+    mem = Perturb(&rc, mem);
+    wo.Observe(mem);
+    observed.push_back(mem);
+
+    // Values are exact until objectives see too many distinct values,
+    // which these can't in 500 observations of small changes.
+    vector<uint8> other = Perturb(&rc, mem);
+    const double v = wo.GetNormalizedValue(other);
+    const double rv = ReferenceNormalizedValue(objs, observed, other);
+    if (v != rv) {
+      fprintf(stderr, "GetNormalizedValue got %f but expected %f\n", v, rv);
+      abort();
+    }
+  }
+
+  // Lots of random observations, so that values get merged. The
+  // results should still be close.
+  for (int t = 0; t < 20000; t++) {
+    for (int i = 0; i < 64; i++) mem[i] = RandomInt32(&rc) & 0xFF;
+    wo.Observe(mem);
+    observed.push_back(mem);
+  }
+  for (int t = 0; t < 10; t++) {
+    for (int i = 0; i < 64; i++) mem[i] = RandomInt32(&rc) & 0xFF;
+    const double v = wo.GetNormalizedValue(mem);
+    const double rv = ReferenceNormalizedValue(objs, observed, mem);
+    if (fabs(v - rv) > 0.01) {
+      fprintf(stderr, "GetNormalizedValue got %f but expected about %f\n",
+	      v, rv);
+      abort();
+    }
+  }
+  fprintf(stderr, "Observe OK.\n");
+}
+
+static vector<int> Locations(int a, int b = -1) {
+  vector<int> v(1, a);
+  if (b >= 0) v.push_back(b);
+  return v;
+}
+
+static void TestMergeEquivalent() {
+  ArcFour rc("merge");
+
+  // Memories where location 0 counts up, location 1 counts up at the
+  // same times, location 2 never changes, and location 3 is random.
+  vector< vector<uint8> > memories;
+  for (int i = 0; i < 200; i++) {
+    vector<uint8> mem(0x800, 0);
+    mem[0] = mem[1] = i / 3;
+    mem[2] = 7;
+    mem[3] = RandomInt32(&rc) & 0xFF;
+    memories.push_back(mem);
+  }
+
+  vector< vector<int> > objs;
+  // These four all rank the memories the same way.
+  objs.push_back(Locations(0));
+  objs.push_back(Locations(1));
+  objs.push_back(Locations(2, 0));
+  objs.push_back(Locations(1, 0));
+  // But this one distinguishes memories with the same count.
+  objs.push_back(Locations(0, 3));
+
+  WeightedObjectives wo(objs);
+  wo.WeightByExamples(memories);
+  vector<double> before;
+  for (int i = 1; i < memories.size(); i++) {
+    before.push_back(wo.Evaluate(memories[i - 1], memories[i]));
+  }
+
+  CHECK(wo.MergeEquivalent(memories) == 3);
+  CHECK(wo.Size() == 2);
+  for (int i = 1; i < memories.size(); i++) {
+    const double after = wo.Evaluate(memories[i - 1], memories[i]);
+    CHECK(fabs(after - before[i - 1]) < 1e-9);
+  }
+  fprintf(stderr, "MergeEquivalent OK.\n");
+}
+
+int main(int argc, char *argv[]) {
+  TestEvaluate();
+  TestObserve();
+  TestMergeEquivalent();
+  fprintf(stderr, "SUCCESS.\n");
   return 0;
 }
@@ -0,0 +1,260 @@
+#include "worker-pool.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "tasbot.h"
+
+// Same limit as MARIONET (MAX_MESSAGE in netutil.h); we only
+// send 4 bytes of length.
+#define MAX_WORKER_MESSAGE (1<<30)
+
+// Write or read exactly len bytes, retrying on partial transfers
+// and interrupts. Returns false on EOF or error.
+static bool WriteAll(int fd, const void *buf, size_t len) {
+  const char *p = (const char *)buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool ReadAll(int fd, void *buf, size_t len) {
+  char *p = (char *)buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    // EOF.
+    if (n == 0) return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool WriteMessage(int fd, const string &s) {
+  CHECK(s.size() < MAX_WORKER_MESSAGE);
+  uint32 len = s.size();
+  return WriteAll(fd, &len, 4) && WriteAll(fd, s.data(), s.size());
+}
+
+static bool ReadMessage(int fd, string *s) {
+  uint32 len;
+  if (!ReadAll(fd, &len, 4)) return false;
+  if (len > MAX_WORKER_MESSAGE) {
+    fprintf(stderr, "Worker message with len too big.\n");
+    return false;
+  }
+  s->resize(len);
+  return len == 0 || ReadAll(fd, &(*s)[0], len);
+}
+
+int WorkerPool::NumProcessors() {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n < 1) ? 1 : (int)n;
+}
+
+WorkerPool::WorkerPool(int num_workers, Worker *worker) {
+  CHECK(num_workers > 0);
+  CHECK(worker != NULL);
+
+  // Otherwise anything buffered gets printed again by every child.
+  fflush(stdout);
+  fflush(stderr);
+
+  for (int i = 0; i < num_workers; i++) {
+    int requests[2], responses[2];
+    CHECK(0 == pipe(requests));
+    CHECK(0 == pipe(responses));
+
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+      // The child only needs its own two ends.
+      close(requests[1]);
+      close(responses[0]);
+      for (int c = 0; c < children.size(); c++) {
+	close(children[c].to_fd);
+	close(children[c].from_fd);
+      }
+      ChildLoop(requests[0], responses[1], worker);
+      // Not reached.
+    }
+
+    close(requests[0]);
+    close(responses[1]);
+    Child child;
+    child.pid = pid;
+    child.to_fd = requests[1];
+    child.from_fd = responses[0];
+    children.push_back(child);
+  }
+
+  fprintf(stderr, "Started %d workers.\n", num_workers);
+}
+
+void WorkerPool::ChildLoop(int read_fd, int write_fd, Worker *worker) {
+  string request, response;
+  // Parent closing the pipe is the signal to exit.
+  while (ReadMessage(read_fd, &request)) {
+    response.clear();
+    worker->DoWork(request, &response);
+    if (!WriteMessage(write_fd, response)) {
+      fprintf(stderr, "Worker %d couldn't write response.\n", getpid());
+      break;
+    }
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+  // Skip the parent's atexit handlers and destructors.
+  _exit(0);
+}
+
+WorkerPool::~WorkerPool() {
+  for (int i = 0; i < children.size(); i++) {
+    close(children[i].to_fd);
+    close(children[i].from_fd);
+  }
+
+  for (int i = 0; i < children.size(); i++) {
+    int status;
+    while (waitpid(children[i].pid, &status, 0) < 0 && errno == EINTR) {}
+  }
+}
+
+void WorkerPool::RunAll(const vector<string> &requests,
+			vector<string> *responses,
+			Progress *progress) {
+  responses->clear();
+  responses->resize(requests.size());
+
+  // Index of the request each child is working on, or -1 if idle.
+  vector<int> working(children.size(), -1);
+  int next = 0, done = 0;
+
+  while (done < requests.size()) {
+    // Give work to any idle children.
+    for (int c = 0; c < children.size() && next < requests.size(); c++) {
+      if (working[c] == -1) {
+	string request;
+	if (progress != NULL) {
+	  request = requests[next];
+	  progress->Sending(next, &request);
+	}
+	if (!WriteMessage(children[c].to_fd,
+			  progress != NULL ? request : requests[next])) {
+	  fprintf(stderr, "Couldn't send work to worker %d.\n",
+		  children[c].pid);
+	  abort();
+	}
+	working[c] = next;
+	next++;
+      }
+    }
+
+    // Wait for any of the busy ones to answer.
+    vector<struct pollfd> fds;
+    vector<int> which;
+    for (int c = 0; c < children.size(); c++) {
+      if (working[c] != -1) {
+	struct pollfd pfd;
+	pfd.fd = children[c].from_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	fds.push_back(pfd);
+	which.push_back(c);
+      }
+    }
+    CHECK(!fds.empty());
+
+    if (poll(&fds[0], fds.size(), -1) < 0) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      abort();
+    }
+
+    for (int i = 0; i < fds.size(); i++) {
+      if (fds[i].revents == 0) continue;
+      const int c = which[i];
+      // Readable or hung up; either way a complete message or
+      // nothing at all.
+      if (!ReadMessage(children[c].from_fd, &(*responses)[working[c]])) {
+	fprintf(stderr, "Worker %d died on request #%d.\n",
+		children[c].pid, working[c]);
+	abort();
+      }
+      if (progress != NULL) {
+	progress->Received(working[c], (*responses)[working[c]]);
+      }
+      working[c] = -1;
+      done++;
+    }
+  }
+}
+
+void WorkerPool::Writer::Int(int64 i) {
+  out->append((const char *)&i, sizeof (i));
+}
+
+void WorkerPool::Writer::Double(double d) {
+  out->append((const char *)&d, sizeof (d));
+}
+
+void WorkerPool::Writer::Bytes(const vector<uint8> &v) {
+  Int(v.size());
+  if (!v.empty()) out->append((const char *)&v[0], v.size());
+}
+
+void WorkerPool::Writer::String(const string &s) {
+  Int(s.size());
+  out->append(s);
+}
+
+void WorkerPool::Reader::Read(void *dest, size_t len) {
+  CHECK(pos + len <= in.size());
+  memcpy(dest, in.data() + pos, len);
+  pos += len;
+}
+
+int64 WorkerPool::Reader::Int() {
+  int64 i;
+  Read(&i, sizeof (i));
+  return i;
+}
+
+double WorkerPool::Reader::Double() {
+  double d;
+  Read(&d, sizeof (d));
+  return d;
+}
+
+void WorkerPool::Reader::Bytes(vector<uint8> *v) {
+  int64 len = Int();
+  CHECK(len >= 0);
+  v->resize(len);
+  if (len > 0) Read(&(*v)[0], len);
+}
+
+string WorkerPool::Reader::String() {
+  int64 len = Int();
+  CHECK(len >= 0);
+  CHECK(pos + len <= in.size());
+  string s = in.substr(pos, len);
+  pos += len;
+  return s;
+}
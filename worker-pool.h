@@ -0,0 +1,120 @@
+/* Runs work in forked copies of the current process.
+
+   FCEUX keeps the whole machine state in globals (RAM, the CPU
+   registers, PPU and APU state, the mapper's registered SFORMATs,
+   the read/write handler tables and so on), so one address space can
+   only hold one emulator. Rather than rewriting the emulator around a
+   context object, a worker is a fork() of the process after it has
+   been initialized: it gets its own private copy-on-write copy of all
+   of that state, including the loaded ROM, the state cache, and
+   whatever the parent did before forking (like replaying the warmup
+   inputs). Each worker then behaves like a MARIONET helper, but
+   without SDL_net, protobufs, TCP sockets, or reloading the game.
+
+   Workers are snapshots of the parent at the time the pool is
+   created. Changes the parent makes afterwards (to the emulator,
+   objectives, motifs, ...) are not seen by the workers, and
+   vice versa, so everything a request depends on that can change
+   must be sent along with it. This is the same discipline that
+   MARIONET helpers already need.
+
+   Requests and responses are opaque byte strings; see the
+   WorkerPool::Writer and Reader helpers for building them. */
+
+#ifndef __WORKER_POOL_H
+#define __WORKER_POOL_H
+
+#include <vector>
+#include <string>
+
+#include <sys/types.h>
+
+#include "tasbot.h"
+
+struct WorkerPool {
+  // Implemented by the client. DoWork is only ever called in the
+  // worker processes.
+  struct Worker {
+    virtual ~Worker() {}
+    virtual void DoWork(const string &request, string *response) = 0;
+  };
+
+  // Forks num_workers processes (must be positive) that each loop
+  // running worker->DoWork on requests. The worker object is used
+  // in the children, so it just needs to be alive at the time of
+  // the fork.
+  WorkerPool(int num_workers, Worker *worker);
+
+  // Stops and reaps the worker processes.
+  ~WorkerPool();
+
+  int Size() const { return children.size(); }
+
+  // Optional hooks for RunAll, called in the parent, so that
+  // requests can depend on the responses that came back before
+  // they were sent.
+  struct Progress {
+    virtual ~Progress() {}
+    // Just before the request with index idx is sent. It may be
+    // modified (it's a copy).
+    virtual void Sending(int idx, string *request) {}
+    // As soon as the response to the request idx arrives.
+    virtual void Received(int idx, const string &response) {}
+  };
+
+  // Runs every request on some worker, in parallel, and blocks until
+  // they are all done. The responses vector is cleared and gets one
+  // response for each request, in the same order. Requests are sent
+  // in order as workers become free. Aborts if a worker dies.
+  void RunAll(const vector<string> &requests, vector<string> *responses,
+	      Progress *progress = NULL);
+
+  // Number of processors online, which is a reasonable default for
+  // the number of workers. Always at least 1.
+  static int NumProcessors();
+
+  // Little helpers for marshalling requests and responses. Both
+  // sides are the same binary, so this is just the raw bytes in
+  // native byte order, with lengths before variable-sized data.
+  struct Writer {
+    explicit Writer(string *out) : out(out) {}
+    void Int(int64 i);
+    void Double(double d);
+    void Bytes(const vector<uint8> &v);
+    void String(const string &s);
+   private:
+    string *out;
+  };
+
+  // Aborts if the input is truncated.
+  struct Reader {
+    explicit Reader(const string &in) : in(in), pos(0) {}
+    int64 Int();
+    double Double();
+    void Bytes(vector<uint8> *v);
+    string String();
+    bool Done() const { return pos == in.size(); }
+   private:
+    void Read(void *dest, size_t len);
+    const string &in;
+    size_t pos;
+  };
+
+ private:
+  struct Child {
+    pid_t pid;
+    // Parent writes requests to this one.
+    int to_fd;
+    // ... and reads responses from this one.
+    int from_fd;
+  };
+
+  // Main loop in the child process. Never returns.
+  static void ChildLoop(int read_fd, int write_fd, Worker *worker);
+
+  vector<Child> children;
+
+  NOT_COPYABLE(WorkerPool);
+};
+
+#endif